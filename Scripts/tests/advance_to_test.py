@@ -0,0 +1,74 @@
+# Check that EmuSimulation.AdvanceTo can be called repeatedly:
+# AdvanceTo(t1); AdvanceTo(t2) must reproduce AdvanceTo(t2), and the calls
+# together must not take more than nsteps steps.
+#
+# Run from a directory with the emu module (make python USE_PYTHON=TRUE), e.g.
+#     python3 advance_to_test.py inputs_fast_flavor
+# The timestep is fixed by cfl_factor alone and t1 is put just before a step
+# boundary, so both runs take the same steps and agree to roundoff.
+
+import numpy as np
+import argparse
+import emu
+
+parser = argparse.ArgumentParser()
+parser.add_argument("inputs", help="Emu inputs file")
+parser.add_argument("-na", "--no_assert", action="store_true", help="If --no_assert is supplied, do not raise assertion errors if the test error > tolerance.")
+args = parser.parse_args()
+
+nsteps = 10
+nsteps_first = 4
+seed = 12345
+tolerance = 1e-8
+
+def particle_data(sim):
+    # all particles on this rank, in an order independent of the tiles and ids
+    data = np.concatenate([np.array(tile) for tile in sim.particles()])
+    names = sim.attribute_names
+    keys = [data[:,names.index(key)] for key in ["pupz","pupy","pupx","z","y","x"]]
+    return data[np.lexsort(keys)], names
+
+def myassert(condition):
+    if not args.no_assert:
+        assert(condition)
+
+if __name__ == "__main__":
+
+    emu.initialize([args.inputs, "nsteps="+str(nsteps), "end_time=1.0",
+                    "cfl_factor=0.5", "flavor_cfl_factor=-1",
+                    "write_plot_every="+str(2*nsteps), "write_plot_particles_every=0"])
+
+    # one call, ended by the step budget
+    whole = emu.Simulation(seed)
+    whole.advance_to(1.0)
+    whole_data, names = particle_data(whole)
+    whole_step, whole_time = whole.step, whole.time
+    del whole
+    dt = whole_time / nsteps
+
+    # two calls, the first ended by its target time
+    split = emu.Simulation(seed)
+    split.advance_to(nsteps_first*dt*(1.-1e-12))
+    first_step = split.step
+    split.advance_to(1.0)
+    split_data, _ = particle_data(split)
+    split_step, split_time = split.step, split.time
+    del split
+
+    print("steps:", whole_step, "in one call,", first_step, "+", split_step-first_step, "in two")
+    myassert(whole_step == nsteps)
+    myassert(first_step == nsteps_first)
+    myassert(split_step == nsteps)
+
+    time_error = abs(split_time - whole_time) / whole_time
+    print("relative time difference:", time_error)
+    myassert(time_error < tolerance)
+
+    # the flavor state and number of each particle
+    columns = [i for i, name in enumerate(names) if name.startswith("f") or name.startswith("N")]
+    scale = np.max(np.abs(whole_data[:,columns]))
+    error = np.max(np.abs(split_data[:,columns] - whole_data[:,columns])) / scale
+    print("relative particle difference:", error)
+    myassert(error < tolerance)
+
+    emu.finalize()
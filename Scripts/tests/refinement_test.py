@@ -0,0 +1,53 @@
+# Check the deposit into a refined level whose patches cover only part of the
+# domain, so most particles are far from the finer grids.
+#
+# Run after inputs_refinement_test, e.g.
+#     mpirun -np 2 ./main3d.gnu.DEBUG.TPROF.MPI.ex ../sample_inputs/inputs_refinement_test
+#     python ../Scripts/tests/refinement_test.py
+# The particles sit on a lattice with one particle per fine cell and
+# direction, and the B-spline shape factors of a lattice sum to one, so
+# every fine cell holds exactly half the trace of N of its level-0 cell.
+
+import numpy as np
+import argparse
+import glob
+import yt
+
+parser = argparse.ArgumentParser()
+parser.add_argument("-na", "--no_assert", action="store_true", help="If --no_assert is supplied, do not raise assertion errors if the test error > tolerance.")
+args = parser.parse_args()
+
+tolerance = 1e-10
+nflavors = 2
+refinement_ratio = 2 # fine cells per level-0 cell (refined along z only)
+
+def myassert(condition):
+    if not args.no_assert:
+        assert(condition)
+
+def trace(grid, tail):
+    return sum(np.array(grid["boxlib","N{}{}_Re{}".format(a,a,tail)]) for a in range(nflavors))
+
+if __name__ == "__main__":
+
+    plotfile = sorted(glob.glob("plt[0-9][0-9][0-9][0-9][0-9]"))[-1]
+    ds = yt.load(plotfile)
+    grids0 = [g for g in ds.index.grids if g.Level == 0]
+    grids1 = [g for g in ds.index.grids if g.Level == 1]
+
+    # the level must leave most of the domain, and its particles, unrefined
+    fine_cells = sum(g.ActiveDimensions.prod() for g in grids1)
+    fraction = fine_cells / (refinement_ratio * ds.domain_dimensions.prod())
+    print(plotfile, "level 1 has", len(grids1), "grids covering", fraction, "of the domain")
+    myassert(len(grids1) > 0)
+    myassert(fraction < 0.5)
+
+    for tail in ["", "bar"]:
+        coarse = np.concatenate([trace(g, tail).flatten() for g in grids0])
+        fine = np.concatenate([trace(g, tail).flatten() for g in grids1])
+        scale = np.mean(coarse)
+        coarse_error = np.max(np.abs(coarse - scale)) / scale
+        fine_error = np.max(np.abs(refinement_ratio*fine - scale)) / scale
+        print("Tr(N"+tail+"): level 0 variation", coarse_error, "level 1 error", fine_error)
+        myassert(coarse_error < tolerance)
+        myassert(fine_error < tolerance)
@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# Compare particle shape factor orders at matched accuracy using the
+# nonzero-k fast flavor test. Build one executable per order first, e.g.
+#     make SHAPE_FACTOR_ORDER=3 && mv main3d.gnu.TPROF.MPI.ex main3d.gnu.TPROF.MPI.order3.ex
+# For each order, the run time and growth rate error are recorded as the
+# mesh is coarsened, so the cheapest order that meets a given error can be
+# read off shape_factor_benchmark.txt.
+
+# echo the commands
+set -x
+
+# All runs will use these
+DIM=3
+MPINUM=4
+ORDERS="2 3 4"
+NCELLS="50 32 24 16"
+
+# Clean up any existing output files before we start
+rm -rf plt*
+rm -rf shape_factor_benchmark.txt
+
+for ORDER in ${ORDERS}; do
+    EXEC=./main${DIM}d.gnu.TPROF.MPI.order${ORDER}.ex
+    for NCELL in ${NCELLS}; do
+        mpiexec -n ${MPINUM} ${EXEC} inputs_fast_flavor_nonzerok "ncell=(1,1,${NCELL})" > run.log
+        echo "order: ${ORDER}" >> shape_factor_benchmark.txt
+        echo "ncell: ${NCELL}" >> shape_factor_benchmark.txt
+        grep "Run time w/o initialization" run.log >> shape_factor_benchmark.txt
+        grep "particles advanced per microsecond" run.log >> shape_factor_benchmark.txt
+        python3 fast_flavor_k_test.py -na | grep "growth rates / theoretical" >> shape_factor_benchmark.txt
+        rm -rf plt* run.log
+    done
+done
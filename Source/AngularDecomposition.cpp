@@ -0,0 +1,79 @@
+#include "AngularDecomposition.H"
+
+using namespace amrex;
+
+DistributionMapping replicated_distribution_mapping(const BoxArray& ba)
+{
+    Vector<int> ranks(ba.size(), ParallelDescriptor::MyProc());
+    return DistributionMapping(ranks);
+}
+
+DirectionSet owned_directions(const DirectionSet& directions)
+{
+    const int nranks = ParallelDescriptor::NProcs();
+    if (nranks > directions.size())
+        amrex::Error("angular_decomposition requires at least as many directions as ranks");
+
+    DirectionSet owned;
+    for (int i = ParallelDescriptor::MyProc(); i < directions.size(); i += nranks) {
+        owned.xyz.push_back(directions.xyz[i]);
+        owned.weight.push_back(directions.weight[i]);
+    }
+
+    amrex::Print() << "Angular decomposition: " << nranks << " ranks with up to "
+                   << owned.size() << " directions each" << std::endl;
+
+    return owned;
+}
+
+void sum_replicated_mesh(MultiFab& mf, const int start_comp, const int ncomp)
+{
+    BL_PROFILE("sum_replicated_mesh");
+
+    if (ParallelDescriptor::NProcs() == 1) return;
+
+    // pack the components of every box (ghost cells included, they are
+    // overwritten by the next FillBoundary) so a single allreduce suffices
+    Long buffer_size = 0;
+    for (MFIter mfi(mf); mfi.isValid(); ++mfi) buffer_size += mfi.fabbox().numPts() * ncomp;
+    Vector<Real> buffer(buffer_size);
+
+    Long offset = 0;
+    for (MFIter mfi(mf); mfi.isValid(); ++mfi) {
+        const Long n = mfi.fabbox().numPts() * ncomp;
+        const Real* data = mf[mfi].dataPtr(start_comp);
+        Gpu::copyAsync(Gpu::deviceToHost, data, data + n, buffer.begin() + offset);
+        offset += n;
+    }
+    Gpu::streamSynchronize();
+
+    ParallelDescriptor::ReduceRealSum(buffer.data(), buffer.size());
+
+    offset = 0;
+    for (MFIter mfi(mf); mfi.isValid(); ++mfi) {
+        const Long n = mfi.fabbox().numPts() * ncomp;
+        Real* data = mf[mfi].dataPtr(start_comp);
+        Gpu::copyAsync(Gpu::hostToDevice, buffer.begin() + offset, buffer.begin() + offset + n, data);
+        offset += n;
+    }
+    Gpu::streamSynchronize();
+}
+
+void copy_replicated_to_distributed(const MultiFab& replicated, MultiFab& distributed)
+{
+    AMREX_ALWAYS_ASSERT(replicated.boxArray() == distributed.boxArray());
+    AMREX_ALWAYS_ASSERT(replicated.nComp() == distributed.nComp());
+
+    // every box of the replicated MultiFab is local, so look it up by its global index
+    const int ncomp = distributed.nComp();
+    for (MFIter mfi(distributed); mfi.isValid(); ++mfi) {
+        const Box& bx = mfi.validbox();
+        auto const& src = replicated.const_array(mfi.index());
+        auto const& dst = distributed.array(mfi);
+        amrex::ParallelFor(bx, ncomp,
+        [=] AMREX_GPU_DEVICE (int i, int j, int k, int n)
+        {
+            dst(i,j,k,n) = src(i,j,k,n);
+        });
+    }
+}
@@ -0,0 +1,271 @@
+#include "DirectionSets.H"
+#include <cmath>
+#include <algorithm>
+
+using namespace amrex;
+
+void DirectionSet::push_antipodal_pair(const Real x, const Real y, const Real z, const Real w)
+{
+    xyz.push_back(GpuArray<Real,3>{x,y,z});
+    xyz.push_back(GpuArray<Real,3>{-x,-y,-z});
+    weight.push_back(w);
+    weight.push_back(w);
+}
+
+// generate an array of theta,phi pairs that uniformily cover the surface of a sphere
+// based on DOI: 10.1080/10586458.2003.10504492 section 3.3 but specifying n_j=0 instead of n
+Gpu::ManagedVector<GpuArray<Real,3> > uniform_sphere_xyz(int nphi_at_equator){
+	AMREX_ASSERT(nphi_at_equator>0);
+
+	Real dtheta = M_PI*std::sqrt(3)/nphi_at_equator;
+
+	Gpu::ManagedVector<GpuArray<Real,3> > xyz;
+	Real theta = 0;
+	Real phi0 = 0;
+	while(theta < M_PI/2.){
+		int nphi = theta==0 ? nphi_at_equator : lround(nphi_at_equator * std::cos(theta));
+		Real dphi = 2.*M_PI/nphi;
+		if(nphi==1) theta = M_PI/2.;
+
+		for(int iphi=0; iphi<nphi; iphi++){
+			Real phi = phi0 + iphi*dphi;
+			Real x = std::cos(theta) * std::cos(phi);
+			Real y = std::cos(theta) * std::sin(phi);
+			Real z = std::sin(theta);
+			xyz.push_back(GpuArray<Real,3>{x,y,z});
+			// construct exactly opposing vectors to limit subtractive cancellation errors
+			// and be able to represent isotropy exactly (all odd moments == 0)
+			if(theta>0) xyz.push_back(GpuArray<Real,3>{-x,-y,-z});
+		}
+		theta += dtheta;
+		phi0 = phi0 + 0.5*dphi; // offset by half step so adjacent latitudes are not always aligned in longitude
+	}
+
+	return xyz;
+}
+
+DirectionSet uniform_sphere_directions(int nphi_at_equator)
+{
+    DirectionSet directions;
+    directions.xyz = uniform_sphere_xyz(nphi_at_equator);
+    directions.weight.resize(directions.xyz.size(), 1.0/directions.xyz.size());
+    return directions;
+}
+
+namespace
+{
+    bool contains(const DirectionSet& directions, const Real x, const Real y, const Real z)
+    {
+        const Real tolerance = 1e-12;
+        for (int i=0; i<directions.size(); i++) {
+            const auto& u = directions.xyz[i];
+            if (std::abs(u[0]-x) + std::abs(u[1]-y) + std::abs(u[2]-z) < tolerance) return true;
+        }
+        return false;
+    }
+
+    // Add every distinct direction obtained from (a,b,c) by sign changes and by
+    // all permutations (or only cyclic permutations) of the components, normalized
+    // to unit length, each with weight w. The result is closed under negation, so
+    // the directions are added as antipodal pairs.
+    void add_orbit(DirectionSet& directions, Real a, Real b, Real c, const Real w, const bool cyclic_only=false)
+    {
+        const Real length = std::sqrt(a*a + b*b + c*c);
+        a /= length;
+        b /= length;
+        c /= length;
+
+        const Real all_permutations[6][3] = {{a,b,c}, {b,c,a}, {c,a,b}, {a,c,b}, {c,b,a}, {b,a,c}};
+        const int npermutations = cyclic_only ? 3 : 6;
+
+        for (int iperm=0; iperm<npermutations; iperm++) {
+            for (int isign=0; isign<8; isign++) {
+                const Real x = (isign & 1 ? -1 : 1) * all_permutations[iperm][0];
+                const Real y = (isign & 2 ? -1 : 1) * all_permutations[iperm][1];
+                const Real z = (isign & 4 ? -1 : 1) * all_permutations[iperm][2];
+                if (!contains(directions, x, y, z)) directions.push_antipodal_pair(x, y, z, w);
+            }
+        }
+    }
+
+    // (n-1)!! with (-1)!! = 1
+    Real double_factorial(const int n)
+    {
+        Real result = 1;
+        for (int i=n; i>1; i-=2) result *= i;
+        return result;
+    }
+}
+
+// Lebedev & Laikov, Doklady Mathematics 59, 477 (1999)
+DirectionSet lebedev_directions(const int npoints)
+{
+    DirectionSet directions;
+    const Real r2 = 1.0/std::sqrt(2.0);
+
+    if (npoints == 6) {
+        add_orbit(directions, 1, 0, 0, 1./6.);
+    } else if (npoints == 14) {
+        add_orbit(directions, 1, 0, 0, 1./15.);
+        add_orbit(directions, 1, 1, 1, 3./40.);
+    } else if (npoints == 26) {
+        add_orbit(directions, 1, 0, 0, 1./21.);
+        add_orbit(directions, 0, r2, r2, 4./105.);
+        add_orbit(directions, 1, 1, 1, 9./280.);
+    } else if (npoints == 38) {
+        const Real p = 0.4597008433809831;
+        add_orbit(directions, 1, 0, 0, 1./105.);
+        add_orbit(directions, 1, 1, 1, 9./280.);
+        add_orbit(directions, p, std::sqrt(1.0-p*p), 0, 1./35.);
+    } else if (npoints == 50) {
+        add_orbit(directions, 1, 0, 0, 4./315.);
+        add_orbit(directions, 0, r2, r2, 64./2835.);
+        add_orbit(directions, 1, 1, 1, 27./1280.);
+        add_orbit(directions, 1, 1, 3, 14641./725760.);
+    } else {
+        amrex::Error("lebedev_npoints must be 6, 14, 26, 38 or 50");
+    }
+
+    AMREX_ALWAYS_ASSERT(directions.size() == npoints);
+    return directions;
+}
+
+// Vertices of the Platonic solids that are symmetric under inversion
+DirectionSet t_design_directions(const int npoints)
+{
+    DirectionSet directions;
+    const Real golden = 0.5*(1.0 + std::sqrt(5.0));
+    const Real w = 1.0/npoints;
+
+    if (npoints == 6) {
+        add_orbit(directions, 1, 0, 0, w);
+    } else if (npoints == 8) {
+        add_orbit(directions, 1, 1, 1, w);
+    } else if (npoints == 12) {
+        add_orbit(directions, 0, 1, golden, w, true);
+    } else if (npoints == 20) {
+        add_orbit(directions, 1, 1, 1, w);
+        add_orbit(directions, 0, 1./golden, golden, w, true);
+    } else {
+        amrex::Error("t_design_npoints must be 6, 8, 12 or 20");
+    }
+
+    AMREX_ALWAYS_ASSERT(directions.size() == npoints);
+    return directions;
+}
+
+// Gorski et al., ApJ 622, 759 (2005). Only the rings with z>=0 are
+// generated, and each pixel center is added with its antipode.
+DirectionSet healpix_directions(const int nside)
+{
+    AMREX_ALWAYS_ASSERT(nside > 0);
+
+    DirectionSet directions;
+    const Real w = 1.0/(12*nside*nside);
+
+    for (int iring=1; iring<=2*nside; iring++) {
+        Real z, dphi, phi0;
+        int npixels;
+        if (iring < nside) {
+            // polar cap
+            z = 1.0 - iring*iring/(3.0*nside*nside);
+            npixels = 4*iring;
+            dphi = M_PI/(2*iring);
+            phi0 = 0.5*dphi;
+        } else {
+            // equatorial belt
+            z = 4./3. - 2.*iring/(3.*nside);
+            npixels = 4*nside;
+            dphi = M_PI/(2*nside);
+            phi0 = (iring - nside + 1) % 2 == 1 ? 0.5*dphi : dphi;
+        }
+
+        // the pixels on the equator are their own antipodes shifted by pi
+        if (iring == 2*nside) npixels /= 2;
+
+        const Real sintheta = std::sqrt(1.0 - z*z);
+        for (int ipix=0; ipix<npixels; ipix++) {
+            const Real phi = phi0 + ipix*dphi;
+            directions.push_antipodal_pair(sintheta*std::cos(phi), sintheta*std::sin(phi), z, w);
+        }
+    }
+
+    AMREX_ALWAYS_ASSERT(directions.size() == 12*nside*nside);
+    return directions;
+}
+
+DirectionSet axisymmetric_rings(const DirectionSet& directions)
+{
+    const Real tolerance = 1e-12;
+    DirectionSet rings;
+
+    for (int i=0; i<directions.size(); i++) {
+        const Real z = directions.xyz[i][2];
+        int iring = 0;
+        while (iring < rings.size() && std::abs(rings.xyz[iring][2] - z) > tolerance) iring++;
+        if (iring == rings.size()) {
+            rings.xyz.push_back(GpuArray<Real,3>{std::sqrt(std::max(0.0, 1.0-z*z)), 0, z});
+            rings.weight.push_back(0);
+        }
+        rings.weight[iring] += directions.weight[i];
+    }
+
+    return rings;
+}
+
+DirectionSet make_direction_set(const TestParams* parms)
+{
+    DirectionSet directions;
+
+    if (parms->direction_set == "uniform_sphere") {
+        directions = uniform_sphere_directions(parms->nphi_equator);
+        amrex::Print() << "Using " << directions.size() << " directions based on " << parms->nphi_equator << " directions at the equator." << std::endl;
+    } else if (parms->direction_set == "lebedev") {
+        directions = lebedev_directions(parms->lebedev_npoints);
+        amrex::Print() << "Using " << directions.size() << " directions from a Lebedev quadrature." << std::endl;
+    } else if (parms->direction_set == "t_design") {
+        directions = t_design_directions(parms->t_design_npoints);
+        amrex::Print() << "Using " << directions.size() << " directions from a spherical t-design." << std::endl;
+    } else if (parms->direction_set == "healpix") {
+        directions = healpix_directions(parms->healpix_nside);
+        amrex::Print() << "Using " << directions.size() << " directions from HEALPix with nside=" << parms->healpix_nside << "." << std::endl;
+    } else {
+        amrex::Error("direction_set must be uniform_sphere, lebedev, t_design or healpix");
+    }
+
+    print_direction_set_moments(directions, 6);
+
+    if (parms->axisymmetric) {
+        directions = axisymmetric_rings(directions);
+        amrex::Print() << "Axisymmetric mode: evolving one particle for each of the " << directions.size() << " rings of constant z." << std::endl;
+    }
+
+    return directions;
+}
+
+void print_direction_set_moments(const DirectionSet& directions, const int max_degree)
+{
+    Real weight_sum = 0;
+    for (int i=0; i<directions.size(); i++) weight_sum += directions.weight[i];
+    amrex::Print() << "  direction weights sum to 1 + " << weight_sum - 1.0 << std::endl;
+
+    for (int degree=1; degree<=max_degree; degree++) {
+        // compare <x^a y^b z^c> with the exact average over the sphere
+        Real max_error = 0;
+        for (int a=0; a<=degree; a++) {
+            for (int b=0; b<=degree-a; b++) {
+                const int c = degree - a - b;
+                Real moment = 0;
+                for (int i=0; i<directions.size(); i++) {
+                    const auto& u = directions.xyz[i];
+                    moment += directions.weight[i] * std::pow(u[0],a) * std::pow(u[1],b) * std::pow(u[2],c);
+                }
+                Real exact = 0;
+                if (a%2==0 && b%2==0 && c%2==0)
+                    exact = double_factorial(a-1)*double_factorial(b-1)*double_factorial(c-1) / double_factorial(degree+1);
+                max_error = std::max(max_error, std::abs(moment - exact));
+            }
+        }
+        amrex::Print() << "  max error in angular moments of degree " << degree << ": " << max_error << std::endl;
+    }
+}
@@ -0,0 +1,342 @@
+#include "DiscreteOrdinates.H"
+#include "Constants.H"
+#include "HermitianMatrix.H"
+#include "IO.H"
+#include "Refinement.H"
+#include "SaturationMonitor.H"
+#include <cmath>
+#include <iomanip>
+#include <limits>
+
+using namespace amrex;
+
+namespace
+{
+    // n and nbar of one direction
+    template<int NF>
+    constexpr int ncomp_direction = 2*HermitianMatrix<NF>::ncomp;
+
+    // Jiang & Shu, J. Comput. Phys. 126, 202 (1996). Value at the face between
+    // q0 and q1 reconstructed from the upwind side, q(-2)..q(2) = a..e.
+    AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+    Real weno5 (const Real a, const Real b, const Real c, const Real d, const Real e)
+    {
+        const Real q0 = ( 2*a - 7*b + 11*c) / 6.;
+        const Real q1 = (  -b + 5*c +  2*d) / 6.;
+        const Real q2 = ( 2*c + 5*d -    e) / 6.;
+
+        const Real beta0 = 13./12.*(a - 2*b + c)*(a - 2*b + c) + 0.25*(a - 4*b + 3*c)*(a - 4*b + 3*c);
+        const Real beta1 = 13./12.*(b - 2*c + d)*(b - 2*c + d) + 0.25*(b - d)*(b - d);
+        const Real beta2 = 13./12.*(c - 2*d + e)*(c - 2*d + e) + 0.25*(3*c - 4*d + e)*(3*c - 4*d + e);
+
+        // relative to the local magnitude since n spans many orders of magnitude
+        const Real eps = 1e-6*(a*a + b*b + c*c + d*d + e*e) + std::numeric_limits<Real>::min();
+        const Real alpha0 = 0.1 / ((eps + beta0)*(eps + beta0));
+        const Real alpha1 = 0.6 / ((eps + beta1)*(eps + beta1));
+        const Real alpha2 = 0.3 / ((eps + beta2)*(eps + beta2));
+
+        return (alpha0*q0 + alpha1*q1 + alpha2*q2) / (alpha0 + alpha1 + alpha2);
+    }
+
+    // difference of the upwind face values across cell (i,j,k) along dim
+    AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+    Real face_difference (Array4<const Real> const& narr, const int i, const int j, const int k,
+                          const int comp, const int dim, const bool positive)
+    {
+        const IntVect shift = IntVect::TheDimensionVector(dim);
+        auto q = [&] (int m) -> Real {
+            return narr(i + m*shift[0], j + m*shift[1], k + m*shift[2], comp);
+        };
+
+        if (positive)
+            return weno5(q(-2), q(-1), q( 0), q( 1), q( 2)) - weno5(q(-3), q(-2), q(-1), q( 0), q( 1));
+        else
+            return weno5(q( 3), q( 2), q( 1), q( 0), q(-1)) - weno5(q( 2), q( 1), q( 0), q(-1), q(-2));
+    }
+}
+
+template<int NF>
+DiscreteOrdinates<NF>::DiscreteOrdinates(const Geometry& a_geom, const BoxArray& ba,
+                                         const DistributionMapping& dm, const TestParams* a_parms)
+    : geom(a_geom), parms(a_parms)
+{
+    directions = make_direction_set(parms);
+
+    // the WENO stencil reaches three cells past the cell in the directions that are resolved
+    IntVect ngrow(0);
+    for (int dim=0; dim<AMREX_SPACEDIM; dim++) {
+        if (geom.Domain().length(dim) > 1) {
+            ngrow[dim] = 3;
+            AMREX_ALWAYS_ASSERT(geom.Domain().length(dim) >= ngrow[dim]);
+        }
+    }
+
+    const int ncomp = directions.size() * ncomp_direction<NF>;
+    n_old  .define(ba, dm, ncomp, ngrow);
+    n_stage.define(ba, dm, ncomp, ngrow);
+    rhs    .define(ba, dm, ncomp, 0);
+
+    amrex::Print() << "Discrete ordinates: " << directions.size() << " directions, "
+                   << ncomp << " components per cell" << std::endl;
+}
+
+template<int NF>
+void DiscreteOrdinates<NF>::InitFromParticles(const FlavoredNeutrinoContainer<NF>& neutrinos)
+{
+    BL_PROFILE("DiscreteOrdinates::InitFromParticles");
+
+    using PIdx = ::PIdx<NF>;
+    using FlavorMatrix = HermitianMatrix<NF>;
+    using ParticleType = typename FlavoredNeutrinoContainer<NF>::ParticleType;
+    constexpr int ncomp_direction = ::ncomp_direction<NF>;
+
+    // the potential of each direction is evaluated with a single energy
+    Real pupt_min = amrex::ReduceMin(neutrinos, [=] AMREX_GPU_DEVICE (const ParticleType& p) -> Real { return p.rdata(PIdx::pupt); });
+    Real pupt_max = amrex::ReduceMax(neutrinos, [=] AMREX_GPU_DEVICE (const ParticleType& p) -> Real { return p.rdata(PIdx::pupt); });
+    ParallelDescriptor::ReduceRealMin(pupt_min);
+    ParallelDescriptor::ReduceRealMax(pupt_max);
+    if (pupt_max - pupt_min > 1e-12*pupt_max)
+        amrex::Error("engine = discrete_ordinates requires all particles to have the same energy");
+    energy = pupt_max;
+
+    const auto plo = geom.ProbLoArray();
+    const auto dxi = geom.InvCellSizeArray();
+    const auto* xyz = directions.xyz.dataPtr();
+    const int ndirections = directions.size();
+
+    n_old.setVal(0.0);
+    amrex::ParticleToMesh(neutrinos, n_old, 0,
+    [=] AMREX_GPU_DEVICE (const ParticleType& p,
+                          amrex::Array4<amrex::Real> const& narr)
+    {
+        const int i = static_cast<int>(amrex::Math::floor((p.pos(0) - plo[0]) * dxi[0]));
+        const int j = static_cast<int>(amrex::Math::floor((p.pos(1) - plo[1]) * dxi[1]));
+        const int k = static_cast<int>(amrex::Math::floor((p.pos(2) - plo[2]) * dxi[2]));
+
+        // the particle velocities are the directions of the set, so pick the closest
+        int d_nearest = 0;
+        Real cos_nearest = -2;
+        for (int d=0; d<ndirections; d++) {
+            const Real cos_angle = xyz[d][0]*p.rdata(PIdx::pupx) + xyz[d][1]*p.rdata(PIdx::pupy) + xyz[d][2]*p.rdata(PIdx::pupz);
+            if (cos_angle > cos_nearest) {
+                cos_nearest = cos_angle;
+                d_nearest = d;
+            }
+        }
+
+        const int start = d_nearest*ncomp_direction;
+        for (int icomp=0; icomp<FlavorMatrix::ncomp; icomp++) {
+            amrex::Gpu::Atomic::AddNoRet(&narr(i,j,k, start + icomp),
+                                         p.rdata(PIdx::N) * p.rdata(PIdx::f00_Re + icomp));
+            amrex::Gpu::Atomic::AddNoRet(&narr(i,j,k, start + FlavorMatrix::ncomp + icomp),
+                                         p.rdata(PIdx::Nbar) * p.rdata(PIdx::f00_Rebar + icomp));
+        }
+    });
+}
+
+template<int NF>
+void DiscreteOrdinates<NF>::DepositMoments(const MultiFab& n, MultiFab& state) const
+{
+    BL_PROFILE("DiscreteOrdinates::DepositMoments");
+
+    constexpr int ncomp_direction = ::ncomp_direction<NF>;
+
+    const auto* xyz = directions.xyz.dataPtr();
+    const int ndirections = directions.size();
+
+#ifdef _OPENMP
+#pragma omp parallel if (Gpu::notInLaunchRegion())
+#endif
+    for (MFIter mfi(state, TilingIfNotGPU()); mfi.isValid(); ++mfi)
+    {
+        const Box& bx = mfi.tilebox();
+        auto const& narr = n.const_array(mfi);
+        auto const& sarr = state.array(mfi);
+
+        // the mesh stores N, Nbar, Fx, Fxbar, Fy, Fybar, Fz, Fzbar
+        amrex::ParallelFor(bx, ncomp_direction,
+        [=] AMREX_GPU_DEVICE (int i, int j, int k, int comp)
+        {
+            Real moment[4] = {0, 0, 0, 0};
+            for (int d=0; d<ndirections; d++) {
+                const Real value = narr(i,j,k, d*ncomp_direction + comp);
+                moment[0] += value;
+                moment[1] += value * xyz[d][0];
+                moment[2] += value * xyz[d][1];
+                moment[3] += value * xyz[d][2];
+            }
+            for (int m=0; m<4; m++)
+                sarr(i,j,k, GIdx<NF>::N00_Re + m*ncomp_direction + comp) = moment[m];
+        });
+    }
+
+    state.FillBoundary(geom.periodicity());
+}
+
+template<int NF>
+void DiscreteOrdinates<NF>::ComputeRHS(const MultiFab& n, MultiFab& a_rhs, const MultiFab& state) const
+{
+    BL_PROFILE("DiscreteOrdinates::ComputeRHS");
+
+    using FlavorMatrix = HermitianMatrix<NF>;
+    constexpr int ncomp_direction = ::ncomp_direction<NF>;
+
+    const auto dxi = geom.InvCellSizeArray();
+    const Real inv_cell_volume = dxi[0]*dxi[1]*dxi[2];
+    const Real sqrt2GF_inv_cell_volume = M_SQRT2*PhysConst::GF*inv_cell_volume;
+    const Real cell_volume_over_Mp = 1.0/(inv_cell_volume*PhysConst::Mp);
+    const Real inv_hbar = 1.0/PhysConst::hbar;
+    constexpr int ncomp_V = 2*FlavorMatrix::ncomp;
+
+    const IntVect resolved(AMREX_D_DECL(geom.Domain().length(0) > 1,
+                                        geom.Domain().length(1) > 1,
+                                        geom.Domain().length(2) > 1));
+    const auto* xyz = directions.xyz.dataPtr();
+    const Real pupt = energy;
+    const FlavorMatrix M2 = flavor_mass_matrix<NF>(parms);
+
+#ifdef _OPENMP
+#pragma omp parallel if (Gpu::notInLaunchRegion())
+#endif
+    for (MFIter mfi(a_rhs, TilingIfNotGPU()); mfi.isValid(); ++mfi)
+    {
+        const Box& bx = mfi.tilebox();
+        auto const& narr = n.const_array(mfi);
+        auto const& sarr = state.const_array(mfi);
+        auto const& rarr = a_rhs.array(mfi);
+
+        amrex::ParallelFor(bx, directions.size(),
+        [=] AMREX_GPU_DEVICE (int i, int j, int k, int d)
+        {
+            const auto& u = xyz[d];
+            const OrdinateMomentum p{{u[0]*pupt, u[1]*pupt, u[2]*pupt, pupt}};
+
+            // potential (vacuum, matter and self-interaction) seen by this direction at the cell center
+            amrex::Real V[ncomp_V];
+            cell_center_potential<NF>(p, sarr, i, j, k, sqrt2GF_inv_cell_volume, cell_volume_over_Mp, M2, V);
+
+            for (int tail = 0; tail < 2; ++tail) {
+                const int start = d*ncomp_direction + tail*FlavorMatrix::ncomp;
+
+                FlavorMatrix H, nmatrix;
+                H.load(&V[tail*FlavorMatrix::ncomp]);
+                nmatrix.load(&narr(i,j,k,start), static_cast<int>(narr.nstride));
+                FlavorMatrix dndt = FlavorMatrix::minus_i_commutator(H, nmatrix);
+                dndt *= inv_hbar;
+
+                for (int dim = 0; dim < AMREX_SPACEDIM; ++dim) {
+                    if (!resolved[dim]) continue;
+                    const Real rate = PhysConst::c * u[dim] * dxi[dim];
+                    for (int icomp = 0; icomp < FlavorMatrix::ncomp; ++icomp)
+                        dndt.c[icomp] -= rate * face_difference(narr, i, j, k, start+icomp, dim, u[dim] >= 0);
+                }
+
+                dndt.store(&rarr(i,j,k,start), static_cast<int>(rarr.nstride));
+            }
+        });
+    }
+}
+
+template<int NF>
+void DiscreteOrdinates<NF>::Advance(MultiFab& state, const Real dt)
+{
+    BL_PROFILE("DiscreteOrdinates::Advance");
+
+    // Shu & Osher, J. Comput. Phys. 77, 439 (1988)
+    const int ncomp = n_old.nComp();
+
+    // n1 = n + dt L(n)
+    n_old.FillBoundary(geom.periodicity());
+    ComputeRHS(n_old, rhs, state);
+    MultiFab::LinComb(n_stage, 1.0, n_old, 0, dt, rhs, 0, 0, ncomp, 0);
+
+    // n2 = 3/4 n + 1/4 (n1 + dt L(n1))
+    n_stage.FillBoundary(geom.periodicity());
+    DepositMoments(n_stage, state);
+    ComputeRHS(n_stage, rhs, state);
+    MultiFab::Saxpy(n_stage, dt, rhs, 0, 0, ncomp, 0);
+    MultiFab::LinComb(n_stage, 0.75, n_old, 0, 0.25, n_stage, 0, 0, ncomp, 0);
+
+    // n_new = 1/3 n + 2/3 (n2 + dt L(n2))
+    n_stage.FillBoundary(geom.periodicity());
+    DepositMoments(n_stage, state);
+    ComputeRHS(n_stage, rhs, state);
+    MultiFab::Saxpy(n_stage, dt, rhs, 0, 0, ncomp, 0);
+    MultiFab::LinComb(n_old, 1./3., n_old, 0, 2./3., n_stage, 0, 0, ncomp, 0);
+
+    // the moments at the new time
+    DepositMoments(n_old, state);
+}
+
+template<int NF>
+void evolve_discrete_ordinates(const FlavoredNeutrinoContainer<NF>& neutrinos, MultiFab& state,
+                               const Geometry& geom, const TestParams* parms)
+{
+    DiscreteOrdinates<NF> ordinates(geom, state.boxArray(), state.DistributionMap(), parms);
+    ordinates.InitFromParticles(neutrinos);
+
+    LocalPotentialMax potential;
+    ordinates.DepositMoments(state);
+    compute_local_potential_max<NF>(state, geom, potential);
+
+    // the particles are not evolved, so only the mesh is written
+    WritePlotFile(state, neutrinos, geom, 0.0, 0, 0);
+
+    std::unique_ptr<SaturationMonitor> saturation_monitor;
+    if (parms->saturation_monitor) saturation_monitor = std::make_unique<SaturationMonitor>(parms);
+
+    amrex::Print() << "Starting discrete-ordinates timestepping loop... " << std::endl;
+
+    const Real start_time = amrex::second();
+
+    Real time = 0.0;
+    int nsteps_taken = 0;
+    Real dt = compute_dt<NF>(geom, parms->cfl_factor, potential, parms->flavor_cfl_factor, parms->max_adaptive_speedup);
+    for (int step = 0; step < parms->nsteps && time < parms->end_time; ++step) {
+        dt = std::min(dt, parms->end_time - time);
+        ordinates.Advance(state, dt);
+        compute_local_potential_max<NF>(state, geom, potential);
+        time += dt;
+        nsteps_taken++;
+
+        amrex::Print() << "Completed time step: " << step << " t = " << time << " s.  ct = " << PhysConst::c * time << " cm" << std::endl;
+
+        ReductionAggregator reductions;
+        const TimestepReductionSlots dt_slots = queue_dt_reductions(potential, parms->flavor_cfl_factor, reductions);
+        if (saturation_monitor) saturation_monitor->Queue<NF>(state, reductions);
+        reductions.Start();
+
+        if (parms->amr_tag_every > 0 && (step+1) % parms->amr_tag_every == 0)
+            report_refinement<NF>(state, geom, parms);
+
+        const bool write_plot = (step+1) % parms->write_plot_every == 0;
+        if (write_plot) WritePlotFile(state, neutrinos, geom, time, step+1, 0);
+
+        reductions.Finish();
+        if (saturation_monitor) saturation_monitor->Collect(reductions, time);
+        dt = compute_dt<NF>(geom, parms->cfl_factor, parms->flavor_cfl_factor, parms->max_adaptive_speedup, reductions, dt_slots);
+
+        if (saturation_monitor && saturation_monitor->ShouldStop(time)) {
+            if (!write_plot) WritePlotFile(state, neutrinos, geom, time, step+1, 0);
+            amrex::Print() << "Stopping " << parms->saturation_stop_after << " s after saturation." << std::endl;
+            break;
+        }
+    }
+
+    const Real advance_time = amrex::second() - start_time;
+
+    amrex::Print() << "Done. " << std::endl;
+
+    amrex::Print() << "Run time w/o initialization (seconds) = " << std::fixed << std::setprecision(3) << advance_time << std::endl;
+
+    // comparable to the particles advanced per microsecond of the particle engine
+    const Real run_fom = static_cast<Real>(ordinates.NumCellDirections()) * nsteps_taken / advance_time / 1.e6;
+    amrex::Print() << "Average number of cell-directions advanced per microsecond = " << std::fixed << std::setprecision(3) << run_fom << std::endl;
+
+    if (saturation_monitor) saturation_monitor->PrintSummary();
+}
+
+template class DiscreteOrdinates<2>;
+template class DiscreteOrdinates<3>;
+template void evolve_discrete_ordinates(const FlavoredNeutrinoContainer<2>&, MultiFab&, const Geometry&, const TestParams*);
+template void evolve_discrete_ordinates(const FlavoredNeutrinoContainer<3>&, MultiFab&, const Geometry&, const TestParams*);
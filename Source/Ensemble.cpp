@@ -0,0 +1,140 @@
+#include "Ensemble.H"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <AMReX.H>
+#include <AMReX_ParmParse.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_Utility.H>
+
+using namespace amrex;
+
+Vector<EnsembleOverrides> read_ensemble_file(const std::string& filename)
+{
+    Vector<char> file_chars;
+    ParallelDescriptor::ReadAndBcastFile(filename, file_chars);
+    std::istringstream file(file_chars.dataPtr());
+
+    Vector<EnsembleOverrides> members;
+    std::string line;
+    while (std::getline(file, line)) {
+        line = line.substr(0, line.find('#'));
+
+        EnsembleOverrides overrides;
+        std::istringstream tokens(line);
+        std::string token;
+        while (tokens >> token) {
+            const std::size_t equals = token.find('=');
+            if (equals == std::string::npos || equals == 0 || equals+1 == token.size())
+                amrex::Error("ensemble_file: expected key=value but found '" + token + "'");
+            overrides.emplace_back(token.substr(0, equals), token.substr(equals+1));
+        }
+        if (not overrides.empty()) members.push_back(overrides);
+    }
+
+    if (members.empty()) amrex::Error("ensemble_file " + filename + " has no members");
+
+    return members;
+}
+
+void run_ensemble(int argc, char* argv[], const Vector<EnsembleOverrides>& members,
+                  const int ranks_per_member, const std::function<void()>& run_member)
+{
+    const int nmembers = members.size();
+
+    int world_rank = 0;
+    int group = 0;
+    int group_rank = 0;
+    MPI_Comm group_comm = MPI_COMM_WORLD;
+
+#ifdef AMREX_USE_MPI
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    group = world_rank / ranks_per_member;
+    MPI_Comm_split(MPI_COMM_WORLD, group, world_rank, &group_comm);
+    MPI_Comm_rank(group_comm, &group_rank);
+
+    // the index of the next unstarted member lives on world rank 0
+    int* next_member_counter = nullptr;
+    MPI_Win counter_window;
+    MPI_Win_allocate(world_rank == 0 ? sizeof(int) : 0, sizeof(int), MPI_INFO_NULL,
+                     MPI_COMM_WORLD, &next_member_counter, &counter_window);
+    if (world_rank == 0) {
+        MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, counter_window);
+        *next_member_counter = 0;
+        MPI_Win_unlock(0, counter_window);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+#else
+    int next_member_counter = 0;
+#endif
+
+    // the group leader takes a member and tells the rest of the group
+    auto take_member = [&] () {
+        int index = 0;
+#ifdef AMREX_USE_MPI
+        if (group_rank == 0) {
+            const int one = 1;
+            MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, counter_window);
+            MPI_Fetch_and_op(&one, &index, MPI_INT, 0, 0, MPI_SUM, counter_window);
+            MPI_Win_unlock(0, counter_window);
+        }
+        MPI_Bcast(&index, 1, MPI_INT, 0, group_comm);
+#else
+        index = next_member_counter++;
+#endif
+        return index;
+    };
+
+    const std::filesystem::path launch_directory = std::filesystem::current_path();
+
+    for (int index = take_member(); index < nmembers; index = take_member()) {
+        const std::string directory = amrex::Concatenate("ensemble_member_", index, 5);
+        const EnsembleOverrides& overrides = members[index];
+
+        std::ofstream output;
+        if (group_rank == 0) {
+            std::filesystem::create_directories(directory);
+            std::ofstream overrides_file(directory + "/ensemble_overrides");
+            for (const auto& [key, value] : overrides) overrides_file << key << " = " << value << "\n";
+            output.open(directory + "/output.txt");
+            std::cout << "Ensemble member " << index << " of " << nmembers
+                      << " started on group " << group << std::endl;
+        }
+#ifdef AMREX_USE_MPI
+        MPI_Barrier(group_comm);
+#endif
+
+        const auto start = std::chrono::steady_clock::now();
+
+        // the overrides are added after the inputs and command line, so they take precedence
+        int member_argc = argc;
+        char** member_argv = argv;
+        amrex::Initialize(member_argc, member_argv, true, group_comm,
+            [&] () {
+                ParmParse pp;
+                for (const auto& [key, value] : overrides) pp.add(key.c_str(), value);
+            },
+            group_rank == 0 ? static_cast<std::ostream&>(output) : std::cout);
+
+        std::filesystem::current_path(directory);
+        run_member();
+        std::filesystem::current_path(launch_directory);
+
+        amrex::Finalize();
+
+        if (group_rank == 0) {
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "Ensemble member " << index << " finished on group " << group
+                      << " in " << elapsed.count() << " s" << std::endl;
+        }
+    }
+
+#ifdef AMREX_USE_MPI
+    MPI_Win_free(&counter_window);
+    MPI_Comm_free(&group_comm);
+#endif
+}
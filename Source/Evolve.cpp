@@ -1,31 +1,53 @@
 #include "Evolve.H"
 #include "Constants.H"
 #include "ParticleInterpolator.H"
+#include "HermitianMatrix.H"
+#include "AngularDecomposition.H"
+#include "Realizations.H"
+#include <AMReX_ParticleReduce.H>
 #include <cmath>
+#include <array>
+#include <complex>
+#include <utility>
 
 using namespace amrex;
 
-namespace GIdx
+template<int NF>
+void GIdx<NF>::Initialize()
 {
-    amrex::Vector<std::string> names;
+    names.resize(0);
+    names.push_back("rho");
+    names.push_back("T");
+    names.push_back("Ye");
+    for (const std::string moment : {"N", "Fx", "Fy", "Fz"})
+        for (const std::string tail : {"", "bar"})
+            for (const std::string& name : HermitianMatrix<NF>::names(moment, tail))
+                names.push_back(name);
 
-    void Initialize()
-    {
-        names.resize(0);
-        names.push_back("rho");
-        names.push_back("T");
-        names.push_back("Ye");
-        #include "generated_files/Evolve.cpp_grid_names_fill"
+    // the moments of the other realizations are suffixed with their index
+    for (int r = 1; r < NUM_REALIZATIONS; ++r)
+        for (int n = N00_Re; n < ncomp_one_realization; ++n)
+            names.push_back(names[n] + "_r" + std::to_string(r));
+}
+
+TimestepReductionSlots queue_dt_reductions(const LocalPotentialMax& potential, const Real flavor_cfl_factor, ReductionAggregator& reductions)
+{
+    TimestepReductionSlots slots;
+
+    // queue the potential maxima from the last deposit for the reduction across MPI ranks
+    if (flavor_cfl_factor > 0.0) {
+	slots.Vmax_adaptive = reductions.AddMax(potential.V_adaptive);
+	slots.Vmax_stupid   = reductions.AddMax(potential.V_stupid  );
     }
+
+    return slots;
 }
 
-Real compute_dt(const Geometry& geom, const Real cfl_factor, const MultiFab& state, const FlavoredNeutrinoContainer& neutrinos, const Real flavor_cfl_factor, const Real max_adaptive_speedup)
+template<int NF>
+Real compute_dt(const Geometry& geom, const Real cfl_factor, const Real flavor_cfl_factor, const Real max_adaptive_speedup, const ReductionAggregator& reductions, const TimestepReductionSlots& slots)
 {
     AMREX_ASSERT(cfl_factor > 0.0 || flavor_cfl_factor > 0.0);
 
-    const auto dx = geom.CellSizeArray();
-    const Real cell_volume = dx[0]*dx[1]*dx[2];
-
 	// translation part of timestep limit
     const auto dxi = geom.CellSizeArray();
     Real dt_translation = 0.0;
@@ -35,34 +57,9 @@ Real compute_dt(const Geometry& geom, const Real cfl_factor, const MultiFab& sta
 
     Real dt_flavor = 0.0;
     if (flavor_cfl_factor > 0.0) {
-        // define the reduction operator to get the max contribution to
-        // the potential from matter and neutrinos
-        // compute "effective" potential (ergs) that produces characteristic timescale
-        // when multiplied by hbar
-        ReduceOps<ReduceOpMax,ReduceOpMax> reduce_op;
-        ReduceData<Real,Real> reduce_data(reduce_op);
-        using ReduceTuple = typename decltype(reduce_data)::Type;
-        for (MFIter mfi(state); mfi.isValid(); ++mfi)
-        {
-            const Box& bx = mfi.fabbox();
-	    auto const& fab = state.array(mfi);
-            reduce_op.eval(bx, reduce_data,
-            [=] AMREX_GPU_DEVICE (int i, int j, int k) -> ReduceTuple
-            {
-                Real V_adaptive=0, V_adaptive2=0, V_stupid=0;
-                #include "generated_files/Evolve.cpp_compute_dt_fill"
-                return {V_adaptive, V_stupid};
-            });
-	}
-
-	// extract the reduced values from the combined reduced data structure
-	auto rv = reduce_data.value();
-	Real Vmax_adaptive = amrex::get<0>(rv) + FlavoredNeutrinoContainer::Vvac_max;
-	Real Vmax_stupid   = amrex::get<1>(rv) + FlavoredNeutrinoContainer::Vvac_max;
-
-	// reduce across MPI ranks
-	ParallelDescriptor::ReduceRealMax(Vmax_adaptive);
-	ParallelDescriptor::ReduceRealMax(Vmax_stupid  );
+	// get the potential maxima reduced across MPI ranks
+	Real Vmax_adaptive = reductions.Max(slots.Vmax_adaptive) + FlavoredNeutrinoContainer<NF>::Vvac_max;
+	Real Vmax_stupid   = reductions.Max(slots.Vmax_stupid  ) + FlavoredNeutrinoContainer<NF>::Vvac_max;
 
 	// define the dt associated with each method
 	Real dt_flavor_adaptive = PhysConst::hbar/Vmax_adaptive*flavor_cfl_factor;
@@ -88,89 +85,767 @@ Real compute_dt(const Geometry& geom, const Real cfl_factor, const MultiFab& sta
     return dt;
 }
 
-void deposit_to_mesh(const FlavoredNeutrinoContainer& neutrinos, MultiFab& state, const Geometry& geom)
+template<int NF>
+Real compute_dt(const Geometry& geom, const Real cfl_factor, const LocalPotentialMax& potential, const Real flavor_cfl_factor, const Real max_adaptive_speedup)
 {
-    const auto plo = geom.ProbLoArray();
-    const auto dxi = geom.InvCellSizeArray();
+    // reduce the potential maxima right away instead of overlapping with other work
+    ReductionAggregator reductions;
+    const TimestepReductionSlots slots = queue_dt_reductions(potential, flavor_cfl_factor, reductions);
+    reductions.Start();
+    reductions.Finish();
 
-    // Create an alias of the MultiFab so ParticleToMesh only erases the quantities
-    // that will be set by the neutrinos.
-    int start_comp = GIdx::N00_Re;
-    int num_comps = GIdx::ncomp - start_comp;
-    MultiFab deposit_state(state, amrex::make_alias, start_comp, num_comps);
+    return compute_dt<NF>(geom, cfl_factor, flavor_cfl_factor, max_adaptive_speedup, reductions, slots);
+}
+
+template<int NF>
+BackgroundMoments compute_background_moments(const FlavoredNeutrinoContainer<NF>& neutrinos, const Geometry& geom)
+{
+    BL_PROFILE("compute_background_moments");
+
+    using FlavorMatrix = HermitianMatrix<NF>;
+    using PIdx = ::PIdx<NF>;
+    using GIdx = ::GIdx<NF>;
+
+    BackgroundMoments background;
+    background.enabled = true;
+    background.values.resize(GIdx::ncomp - GIdx::N00_Re, 0.0);
+
+    // the mesh stores N, Nbar, Fx, Fxbar, Fy, Fybar, Fz, Fzbar
+    const int N_start[2]  = {PIdx::N, PIdx::Nbar};
+    const int bg_start[2] = {PIdx::f00_Re_bg, PIdx::f00_Rebar_bg};
+    for (int moment = 0; moment < 4; ++moment) {
+        for (int tail = 0; tail < 2; ++tail) {
+            for (int a = 0; a < NF; ++a) {
+                const int iN = N_start[tail];
+                const int ibg = bg_start[tail] + a;
+                const int ipup = PIdx::pupx + moment - 1;
+                const Real total = amrex::ReduceSum(neutrinos,
+                [=] AMREX_GPU_HOST_DEVICE (const typename FlavoredNeutrinoContainer<NF>::ParticleType& p) -> Real {
+                    const Real velocity = moment==0 ? 1.0 : p.rdata(ipup)/p.rdata(PIdx::pupt);
+                    return p.rdata(iN) * p.rdata(ibg) * velocity;
+                });
+                background.values[(2*moment + tail)*FlavorMatrix::ncomp + FlavorMatrix::Re(a,a)] = total;
+            }
+        }
+    }
+
+    ParallelDescriptor::ReduceRealSum(background.values.data(), background.values.size());
+    for (auto& value : background.values) value /= geom.Domain().numPts();
+
+    return background;
+}
 
-    const int shape_factor_order_x = geom.Domain().length(0) > 1 ? SHAPE_FACTOR_ORDER : 0;
-    const int shape_factor_order_y = geom.Domain().length(1) > 1 ? SHAPE_FACTOR_ORDER : 0;
-    const int shape_factor_order_z = geom.Domain().length(2) > 1 ? SHAPE_FACTOR_ORDER : 0;
+namespace
+{
+    // For each diagonal component of the deposited moments (realization 0), the
+    // largest difference of a valid cell from reference and the sum over the
+    // cells of the squared difference from the mean
+    struct DiagonalVariation
+    {
+        Real max_difference = 0;
+        Real sum_squares = 0;
+    };
 
-    amrex::ParticleToMesh(neutrinos, deposit_state, 0,
-    [=] AMREX_GPU_DEVICE (const FlavoredNeutrinoContainer::ParticleType& p,
-                          amrex::Array4<amrex::Real> const& sarr)
+    template<int NF>
+    DiagonalVariation diagonal_variation(const MultiFab& mf, const Vector<Real>& reference, const Geometry& geom, const bool replicated_mesh)
     {
-        const amrex::Real delta_x = (p.pos(0) - plo[0]) * dxi[0];
-        const amrex::Real delta_y = (p.pos(1) - plo[1]) * dxi[1];
-        const amrex::Real delta_z = (p.pos(2) - plo[2]) * dxi[2];
-
-        const ParticleInterpolator<SHAPE_FACTOR_ORDER> sx(delta_x, shape_factor_order_x);
-        const ParticleInterpolator<SHAPE_FACTOR_ORDER> sy(delta_y, shape_factor_order_y);
-        const ParticleInterpolator<SHAPE_FACTOR_ORDER> sz(delta_z, shape_factor_order_z);
-
-        for (int k = sz.first(); k <= sz.last(); ++k) {
-            for (int j = sy.first(); j <= sy.last(); ++j) {
-                for (int i = sx.first(); i <= sx.last(); ++i) {
-                    #include "generated_files/Evolve.cpp_deposit_to_mesh_fill"
+        using FlavorMatrix = HermitianMatrix<NF>;
+        using GIdx = ::GIdx<NF>;
+
+        // with a replicated mesh every rank holds every cell
+        auto mesh_reduce_sum = [&] (Real& value) { if (!replicated_mesh) ParallelDescriptor::ReduceRealSum(value); };
+        auto mesh_reduce_max = [&] (Real& value) { if (!replicated_mesh) ParallelDescriptor::ReduceRealMax(value); };
+
+        DiagonalVariation variation;
+        for (int block = 0; block < 8; ++block) {
+            for (int a = 0; a < NF; ++a) {
+                const int comp = GIdx::N00_Re + block*FlavorMatrix::ncomp + FlavorMatrix::Re(a,a);
+                const Real ref = reference[comp - GIdx::N00_Re];
+
+                Real mean = mf.sum(comp, true);
+                mesh_reduce_sum(mean);
+                mean /= geom.Domain().numPts();
+
+                ReduceOps<ReduceOpMax,ReduceOpSum> reduce_op;
+                ReduceData<Real,Real> reduce_data(reduce_op);
+                using ReduceTuple = typename decltype(reduce_data)::Type;
+                for (MFIter mfi(mf); mfi.isValid(); ++mfi) {
+                    auto const& arr = mf.const_array(mfi);
+                    reduce_op.eval(mfi.validbox(), reduce_data,
+                    [=] AMREX_GPU_DEVICE (int i, int j, int k) -> ReduceTuple {
+                        const Real value = arr(i,j,k,comp);
+                        return {std::abs(value - ref), (value - mean)*(value - mean)};
+                    });
                 }
+                auto rv = reduce_data.value();
+                Real max_difference = amrex::get<0>(rv);
+                Real sum_squares = amrex::get<1>(rv);
+                mesh_reduce_max(max_difference);
+                mesh_reduce_sum(sum_squares);
+
+                variation.max_difference = amrex::max(variation.max_difference, max_difference);
+                variation.sum_squares += sum_squares;
             }
         }
-    });
+        return variation;
+    }
+}
+
+template<int NF>
+void check_uniform_background(const FlavoredNeutrinoContainer<NF>& neutrinos, const MultiFab& state, const Geometry& geom,
+                              const BackgroundMoments& background, const bool replicated_mesh)
+{
+    BL_PROFILE("check_uniform_background");
+
+    // at initialization the diagonal of f is the background, so the full
+    // deposit of the diagonal is the background in every cell
+    MultiFab full(state.boxArray(), state.DistributionMap(), state.nComp(), state.nGrowVect());
+    full.setVal(0.0);
+    deposit_to_mesh(neutrinos, full, geom, BackgroundMoments(), replicated_mesh);
+
+    Real scale = 0;
+    for (const Real value : background.values) scale = amrex::max(scale, std::abs(value));
+
+    const DiagonalVariation variation = diagonal_variation<NF>(full, background.values, geom, replicated_mesh);
+    if (variation.max_difference > 1e-8*scale) {
+        amrex::Print() << "delta_f: the background moments differ from their domain average by up to "
+                       << variation.max_difference/scale << " of the largest" << std::endl;
+        amrex::Error("delta_f requires an initial state whose diagonal moments are the same in every cell");
+    }
+}
+
+template<int NF>
+void report_delta_f_noise(const FlavoredNeutrinoContainer<NF>& neutrinos, const MultiFab& state, const Geometry& geom,
+                          const BackgroundMoments& background, const bool replicated_mesh)
+{
+    BL_PROFILE("report_delta_f_noise");
+
+    MultiFab deposit(state.boxArray(), state.DistributionMap(), state.nComp(), state.nGrowVect());
+    const Vector<Real> unused(GIdx<NF>::ncomp - GIdx<NF>::N00_Re, 0.0);
+
+    deposit.setVal(0.0);
+    deposit_to_mesh(neutrinos, deposit, geom, BackgroundMoments(), replicated_mesh);
+    const Real full_variance = diagonal_variation<NF>(deposit, unused, geom, replicated_mesh).sum_squares;
+
+    deposit.setVal(0.0);
+    deposit_to_mesh(neutrinos, deposit, geom, background, replicated_mesh);
+    const Real delta_f_variance = diagonal_variation<NF>(deposit, unused, geom, replicated_mesh).sum_squares;
+
+    amrex::Print() << "  delta-f: cell-to-cell rms variation of the diagonal N and F is "
+                   << (full_variance > 0 ? std::sqrt(delta_f_variance/full_variance) : 1.0)
+                   << " of that of the full deposit (the off-diagonals are not changed)" << std::endl;
+}
+
+namespace
+{
+    // ReduceOps summing one value per deposited component of a realization
+    template<typename Sequence> struct MomentReduction;
+    template<std::size_t... Is>
+    struct MomentReduction<std::index_sequence<Is...> >
+    {
+        template<std::size_t> using Op = ReduceOpSum;
+        template<std::size_t> using Value = Real;
+        using Ops = ReduceOps<Op<Is>...>;
+        using Data = ReduceData<Value<Is>...>;
+        using Tuple = typename Data::Type;
+
+        AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+        static Tuple make_tuple(const Real* values) { return {values[Is]...}; }
+
+        static void copy(const Tuple& sums, Real* values) {
+            const int unused[] = {(values[Is] = amrex::get<Is>(sums), 0)...};
+            amrex::ignore_unused(unused);
+        }
+    };
+
+    // With a single cell every particle deposits its full weight into that
+    // cell, so the moments of each realization are one sum over the particles,
+    // reduced with ReduceOps on the host and the device, with no shape factors
+    // and no atomics.
+    template<int NF>
+    void sum_homogeneous_moments(const FlavoredNeutrinoContainer<NF>& neutrinos, MultiFab& deposit_state, const Real delta_f)
+    {
+        BL_PROFILE("sum_homogeneous_moments");
+
+        using FlavorMatrix = HermitianMatrix<NF>;
+        using PIdx = ::PIdx<NF>;
+        using ParticleType = typename FlavoredNeutrinoContainer<NF>::ParticleType;
+        constexpr int realization_ncomp = ::realization_ncomp<NF>;
+        using Reduction = MomentReduction<std::make_index_sequence<realization_ncomp> >;
+        static_assert(realization_ncomp == 8*FlavorMatrix::ncomp, "the mesh stores N, Nbar, Fx, Fxbar, Fy, Fybar, Fz, Fzbar");
+
+        deposit_state.setVal(0.0);
+
+        for (int r = 0; r < NUM_REALIZATIONS; ++r) {
+            typename Reduction::Ops reduce_ops;
+            const auto sums = amrex::ParticleReduce<typename Reduction::Data>(neutrinos,
+            [=] AMREX_GPU_DEVICE (const ParticleType& particle) -> typename Reduction::Tuple
+            {
+                const RealizationParticle<NF, const ParticleType> p(particle, r);
+                const Real inv_pupt = 1.0/p.rdata(PIdx::pupt);
+                const Real velocity[4] = {1.0, p.rdata(PIdx::pupx)*inv_pupt, p.rdata(PIdx::pupy)*inv_pupt, p.rdata(PIdx::pupz)*inv_pupt};
+
+                Real values[realization_ncomp];
+                const int N_start[2] = {PIdx::N, PIdx::Nbar};
+                const int f_start[2] = {PIdx::f00_Re, PIdx::f00_Rebar};
+                const int bg_start[2] = {PIdx::f00_Re_bg, PIdx::f00_Rebar_bg};
+                for (int tail = 0; tail < 2; ++tail) {
+                    // N*f, minus the background diagonal in delta-f mode
+                    Real Nf[FlavorMatrix::ncomp];
+                    for (int n = 0; n < FlavorMatrix::ncomp; ++n) Nf[n] = p.rdata(f_start[tail] + n);
+                    for (int a = 0; a < NF; ++a) Nf[FlavorMatrix::Re(a,a)] -= delta_f*p.rdata(bg_start[tail] + a);
+                    for (int n = 0; n < FlavorMatrix::ncomp; ++n) Nf[n] *= p.rdata(N_start[tail]);
+
+                    for (int moment = 0; moment < 4; ++moment)
+                        for (int n = 0; n < FlavorMatrix::ncomp; ++n)
+                            values[(2*moment + tail)*FlavorMatrix::ncomp + n] = Nf[n]*velocity[moment];
+                }
+                return Reduction::make_tuple(values);
+            }, reduce_ops);
+
+            Real moments[realization_ncomp];
+            Reduction::copy(sums, moments);
+            for (int n = 0; n < realization_ncomp; ++n)
+                deposit_state.setVal(moments[n], r*realization_ncomp + n, 1, 0);
+        }
+    }
+
+    // Adds the N and F of one particle to the mesh arrays sarr, which start at
+    // GIdx<NF>::N00_Re, with the shape factors of geom
+    template<int NF>
+    struct ParticleDeposit
+    {
+        using FlavorMatrix = HermitianMatrix<NF>;
+        using PIdx = ::PIdx<NF>;
+        using ParticleType = typename FlavoredNeutrinoContainer<NF>::ParticleType;
+
+        amrex::GpuArray<amrex::Real,3> plo, dxi;
+        int shape_factor_order_x, shape_factor_order_y, shape_factor_order_z;
+        amrex::Real delta_f;
+
+        ParticleDeposit(const Geometry& geom, const Real a_delta_f)
+            : plo(geom.ProbLoArray()), dxi(geom.InvCellSizeArray()),
+              shape_factor_order_x(geom.Domain().length(0) > 1 ? SHAPE_FACTOR_ORDER : 0),
+              shape_factor_order_y(geom.Domain().length(1) > 1 ? SHAPE_FACTOR_ORDER : 0),
+              shape_factor_order_z(geom.Domain().length(2) > 1 ? SHAPE_FACTOR_ORDER : 0),
+              delta_f(a_delta_f)
+        {}
+
+        // whether the shape factors of the particle lie within sarr
+        AMREX_GPU_DEVICE
+        bool Reaches(const ParticleType& particle, amrex::Array4<amrex::Real> const& sarr) const
+        {
+            const ParticleInterpolator<SHAPE_FACTOR_ORDER> sx((particle.pos(0) - plo[0]) * dxi[0], shape_factor_order_x);
+            const ParticleInterpolator<SHAPE_FACTOR_ORDER> sy((particle.pos(1) - plo[1]) * dxi[1], shape_factor_order_y);
+            const ParticleInterpolator<SHAPE_FACTOR_ORDER> sz((particle.pos(2) - plo[2]) * dxi[2], shape_factor_order_z);
+            return sx.first() >= sarr.begin.x && sx.last() < sarr.end.x &&
+                   sy.first() >= sarr.begin.y && sy.last() < sarr.end.y &&
+                   sz.first() >= sarr.begin.z && sz.last() < sarr.end.z;
+        }
+
+        AMREX_GPU_DEVICE
+        void operator() (const ParticleType& particle,
+                         amrex::Array4<amrex::Real> const& sarr) const
+        {
+            const amrex::Real delta_x = (particle.pos(0) - plo[0]) * dxi[0];
+            const amrex::Real delta_y = (particle.pos(1) - plo[1]) * dxi[1];
+            const amrex::Real delta_z = (particle.pos(2) - plo[2]) * dxi[2];
+
+            const ParticleInterpolator<SHAPE_FACTOR_ORDER> sx(delta_x, shape_factor_order_x);
+            const ParticleInterpolator<SHAPE_FACTOR_ORDER> sy(delta_y, shape_factor_order_y);
+            const ParticleInterpolator<SHAPE_FACTOR_ORDER> sz(delta_z, shape_factor_order_z);
+
+            const amrex::Real inv_pupt = 1.0/particle.rdata(PIdx::pupt);
+            const amrex::Real velocity[4] = {1.0, particle.rdata(PIdx::pupx)*inv_pupt,
+                                             particle.rdata(PIdx::pupy)*inv_pupt, particle.rdata(PIdx::pupz)*inv_pupt};
+
+            // the shape factors are shared by the realizations, whose moments
+            // are realization_ncomp components apart in sarr
+            for (int r = 0; r < NUM_REALIZATIONS; ++r) {
+                const RealizationParticle<NF, const ParticleType> p(particle, r);
+                const int start_comp = r*realization_ncomp<NF>;
+
+                // the particle's contributions only need to be computed once:
+                // N*f, minus the background diagonal in delta-f mode, for each tail
+                const int N_start[2] = {PIdx::N, PIdx::Nbar};
+                const int f_start[2] = {PIdx::f00_Re, PIdx::f00_Rebar};
+                const int bg_start[2] = {PIdx::f00_Re_bg, PIdx::f00_Rebar_bg};
+                FlavorMatrix dep[2];
+                for (int tail = 0; tail < 2; ++tail) {
+                    for (int n = 0; n < FlavorMatrix::ncomp; ++n) dep[tail].c[n] = p.rdata(f_start[tail] + n);
+                    for (int a = 0; a < NF; ++a) dep[tail].c[FlavorMatrix::Re(a,a)] -= delta_f*p.rdata(bg_start[tail] + a);
+                    dep[tail] *= p.rdata(N_start[tail]);
+                }
+
+                for (int k = sz.first(); k <= sz.last(); ++k) {
+                    for (int j = sy.first(); j <= sy.last(); ++j) {
+                        const amrex::Real weight_jk = sy(j) * sz(k);
+                        for (int i = sx.first(); i <= sx.last(); ++i) {
+                            const amrex::Real weight = sx(i) * weight_jk;
+                            // N, Nbar, Fx, Fxbar, Fy, Fybar, Fz, Fzbar
+                            for (int moment = 0; moment < 4; ++moment) {
+                                for (int tail = 0; tail < 2; ++tail) {
+                                    const int first = start_comp + (2*moment + tail)*FlavorMatrix::ncomp;
+                                    for (int n = 0; n < FlavorMatrix::ncomp; ++n)
+                                        amrex::Gpu::Atomic::AddNoRet(&sarr(i, j, k, first + n), weight*dep[tail].c[n]*velocity[moment]);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    };
+}
+
+template<int NF>
+void deposit_to_mesh(const FlavoredNeutrinoContainer<NF>& neutrinos, MultiFab& state, const Geometry& geom, const BackgroundMoments& background, const bool replicated_mesh)
+{
+    // Create an alias of the MultiFab so ParticleToMesh only erases the quantities
+    // that will be set by the neutrinos.
+    int start_comp = GIdx<NF>::N00_Re;
+    int num_comps = GIdx<NF>::ncomp - start_comp;
+    MultiFab deposit_state(state, amrex::make_alias, start_comp, num_comps);
+
+    // subtract each particle's background diagonal in delta-f mode
+    const amrex::Real delta_f = background.enabled ? 1.0 : 0.0;
+
+    if (geom.Domain().numPts() == 1) {
+        sum_homogeneous_moments(neutrinos, deposit_state, delta_f);
+    } else {
+        amrex::ParticleToMesh(neutrinos, deposit_state, 0, ParticleDeposit<NF>(geom, delta_f));
+    }
+
+    // each rank deposited the particles with its own directions
+    if (replicated_mesh) sum_replicated_mesh(deposit_state, 0, num_comps);
+
+    // add the background moments back in the valid cells
+    if (background.enabled) {
+        for (int n = 0; n < num_comps; ++n)
+            deposit_state.plus(background.values[n], n, 1, 0);
+    }
+}
+
+template<int NF>
+void deposit_to_level(const FlavoredNeutrinoContainer<NF>& neutrinos, MultiFab& mesh, const Vector<int>& box_index, const Geometry& geom)
+{
+    BL_PROFILE("deposit_to_level");
+
+    const int start_comp = GIdx<NF>::N00_Re;
+    const int num_comps = GIdx<NF>::ncomp - start_comp;
+    MultiFab deposit_state(mesh, amrex::make_alias, start_comp, num_comps);
+    deposit_state.setVal(0.0);
+
+    const ParticleDeposit<NF> deposit_particle(geom, 0.0);
+
+    // the tiles of a level-0 box all deposit into its box of mesh
+    const int lev = 0;
+#ifdef _OPENMP
+#pragma omp parallel if (Gpu::notInLaunchRegion())
+#endif
+    for (ParConstIter<PIdx<NF>::nattribs,0,0,0> pti(neutrinos, lev); pti.isValid(); ++pti)
+    {
+        const int index = box_index[pti.index()];
+        if (index < 0) continue;
+
+        const int np = pti.numParticles();
+        const typename FlavoredNeutrinoContainer<NF>::ParticleType* pstruct = &(pti.GetArrayOfStructs()[0]);
+        auto const& sarr = deposit_state.array(index);
+
+        // The copy only covers the part of the box near the level. The particles
+        // whose shape factors leave it do not reach the level or its ghost cells.
+        amrex::ParallelFor(np, [=] AMREX_GPU_DEVICE (int i)
+        {
+            if (deposit_particle.Reaches(pstruct[i], sarr)) deposit_particle(pstruct[i], sarr);
+        });
+    }
 }
 
-void interpolate_rhs_from_mesh(FlavoredNeutrinoContainer& neutrinos_rhs, const MultiFab& state, const Geometry& geom, const TestParams* parms)
+template<int NF>
+void compute_local_potential_max(const MultiFab& state, const Geometry& geom, LocalPotentialMax& potential)
 {
-    const auto plo = geom.ProbLoArray();
-    const auto dxi = geom.InvCellSizeArray();
-    const Real inv_cell_volume = dxi[0]*dxi[1]*dxi[2];
+    using FlavorMatrix = HermitianMatrix<NF>;
+    using GIdx = ::GIdx<NF>;
 
-    const int shape_factor_order_x = geom.Domain().length(0) > 1 ? SHAPE_FACTOR_ORDER : 0;
-    const int shape_factor_order_y = geom.Domain().length(1) > 1 ? SHAPE_FACTOR_ORDER : 0;
-    const int shape_factor_order_z = geom.Domain().length(2) > 1 ? SHAPE_FACTOR_ORDER : 0;
+    const auto dx = geom.CellSizeArray();
+    const Real cell_volume = dx[0]*dx[1]*dx[2];
 
-    amrex::MeshToParticle(neutrinos_rhs, state, 0,
-    [=] AMREX_GPU_DEVICE (FlavoredNeutrinoContainer::ParticleType& p,
-                          amrex::Array4<const amrex::Real> const& sarr)
+    // compute "effective" potential (ergs) that produces characteristic timescale
+    // when multiplied by hbar
+    ReduceOps<ReduceOpMax,ReduceOpMax> reduce_op;
+    ReduceData<Real,Real> reduce_data(reduce_op);
+    using ReduceTuple = typename decltype(reduce_data)::Type;
+    for (MFIter mfi(state); mfi.isValid(); ++mfi)
     {
-        #include "generated_files/Evolve.cpp_Vvac_fill"
+        const Box& bx = mfi.validbox();
+        auto const& state_arr = state.const_array(mfi);
+        reduce_op.eval(bx, reduce_data,
+        [=] AMREX_GPU_DEVICE (int i, int j, int k) -> ReduceTuple
+        {
+            Real V_adaptive_max=0, V_stupid_max=0;
+            for (int r = 0; r < NUM_REALIZATIONS; ++r) {
+                const RealizationMesh<NF, const Real> fab(state_arr, r);
+                const Real matter = fab(i,j,k,GIdx::rho)*fab(i,j,k,GIdx::Ye)/PhysConst::Mp*cell_volume;
 
-        const amrex::Real delta_x = (p.pos(0) - plo[0]) * dxi[0];
-        const amrex::Real delta_y = (p.pos(1) - plo[1]) * dxi[1];
-        const amrex::Real delta_z = (p.pos(2) - plo[2]) * dxi[2];
+                // spherically symmetric part, with the matter potential
+                FlavorMatrix N, Nbar;
+                for (int n = 0; n < FlavorMatrix::ncomp; ++n) {
+                    N.c[n] = fab(i,j,k,GIdx::N00_Re+n);
+                    Nbar.c[n] = fab(i,j,k,GIdx::N00_Rebar+n);
+                }
+                FlavorMatrix HSI = N;
+                HSI -= Nbar.conjugate();
+                HSI.c[0] += matter;
+                Real V_adaptive2 = HSI.SU_vector_magnitude2();
+
+                // flux part
+                const int F_start[3] = {GIdx::Fx00_Re, GIdx::Fy00_Re, GIdx::Fz00_Re};
+                for (int dir = 0; dir < 3; ++dir) {
+                    for (int n = 0; n < FlavorMatrix::ncomp; ++n)
+                        HSI.c[n] = fab(i,j,k,F_start[dir]+n) - fab(i,j,k,F_start[dir]+FlavorMatrix::ncomp+n);
+                    V_adaptive2 += HSI.SU_vector_magnitude2();
+                }
 
-        const ParticleInterpolator<SHAPE_FACTOR_ORDER> sx(delta_x, shape_factor_order_x);
-        const ParticleInterpolator<SHAPE_FACTOR_ORDER> sy(delta_y, shape_factor_order_y);
-        const ParticleInterpolator<SHAPE_FACTOR_ORDER> sz(delta_z, shape_factor_order_z);
+                // put in the units
+                const Real V_adaptive = std::sqrt(V_adaptive2)*M_SQRT2*PhysConst::GF/cell_volume;
 
-        for (int k = sz.first(); k <= sz.last(); ++k) {
-            for (int j = sy.first(); j <= sy.last(); ++j) {
-                for (int i = sx.first(); i <= sx.last(); ++i) {
-                    #include "generated_files/Evolve.cpp_interpolate_from_mesh_fill"
+                // old "stupid" way of computing the timestep.
+                // the factor of 2 accounts for potential worst-case effects of neutrinos and antineutrinos
+                Real V_stupid = amrex::max(0.0, matter);
+                for (int a = 0; a < NF; ++a) {
+                    V_stupid = amrex::max(V_stupid, N.c[FlavorMatrix::Re(a,a)]);
+                    V_stupid = amrex::max(V_stupid, Nbar.c[FlavorMatrix::Re(a,a)]);
                 }
+                V_stupid *= 2.0*NF*M_SQRT2*PhysConst::GF/cell_volume;
+
+                V_adaptive_max = amrex::max(V_adaptive_max, V_adaptive);
+                V_stupid_max = amrex::max(V_stupid_max, V_stupid);
             }
+            return {V_adaptive_max, V_stupid_max};
+        });
+    }
+
+    auto rv = reduce_data.value();
+    potential.V_adaptive = amrex::get<0>(rv);
+    potential.V_stupid   = amrex::get<1>(rv);
+}
+
+namespace
+{
+    template<int NF>
+    using ComplexMatrix = std::array<std::array<std::complex<Real>,NF>,NF>;
+
+    // rotation by theta in the (a,b) plane, with phase delta on the off-diagonals
+    template<int NF>
+    ComplexMatrix<NF> flavor_rotation(const int a, const int b, const Real theta, const Real delta)
+    {
+        ComplexMatrix<NF> R = {};
+        for (int i = 0; i < NF; ++i) R[i][i] = 1;
+        R[a][a] = std::cos(theta);
+        R[a][b] = std::sin(theta)*std::polar(1.0, -delta);
+        R[b][a] = -std::sin(theta)*std::polar(1.0, delta);
+        R[b][b] = std::cos(theta);
+        return R;
+    }
+
+    template<int NF>
+    ComplexMatrix<NF> matrix_product(const ComplexMatrix<NF>& A, const ComplexMatrix<NF>& B)
+    {
+        ComplexMatrix<NF> C = {};
+        for (int i = 0; i < NF; ++i)
+            for (int j = 0; j < NF; ++j)
+                for (int k = 0; k < NF; ++k)
+                    C[i][j] += A[i][k]*B[k][j];
+        return C;
+    }
+}
+
+template<int NF>
+HermitianMatrix<NF> flavor_mass_matrix(const TestParams* parms)
+{
+    static_assert(NF == 2 || NF == 3, "the PMNS matrix is defined for 2 and 3 flavors");
+
+    // PMNS matrix from https://arxiv.org/pdf/1710.00715.pdf, using the first
+    // index as row. The Majorana phases multiply U by a diagonal phase matrix
+    // on the right, which cancels in U M U^dagger.
+    ComplexMatrix<NF> U = flavor_rotation<NF>(0, 1, parms->theta12, 0);
+    const Real mass[3] = {parms->mass1, parms->mass2, parms->mass3};
+    if constexpr (NF == 3) {
+        // U = U23 U13 U12, with the CP phase on the 1-3 rotation
+        const ComplexMatrix<NF> U13 = flavor_rotation<NF>(0, 2, parms->theta13, parms->deltaCP);
+        const ComplexMatrix<NF> U23 = flavor_rotation<NF>(1, 2, parms->theta23, 0);
+        U = matrix_product<NF>(U23, matrix_product<NF>(U13, U));
+    }
+
+    HermitianMatrix<NF> M2;
+    for (int i = 0; i < NF; ++i) {
+        for (int j = i; j < NF; ++j) {
+            std::complex<Real> M2ij = 0;
+            for (int k = 0; k < NF; ++k) M2ij += U[i][k]*mass[k]*mass[k]*std::conj(U[j][k]);
+            M2.c[HermitianMatrix<NF>::Re(i,j)] = M2ij.real();
+            if (j > i) M2.c[HermitianMatrix<NF>::Im(i,j)] = M2ij.imag();
         }
+    }
+    return M2;
+}
+
+template<int NF>
+void interpolate_rhs_from_mesh(FlavoredNeutrinoContainer<NF>& neutrinos_rhs, const MultiFab& state, const Geometry& geom, const TestParams* parms)
+{
+    ParticleMeshLevel level;
+    level.mesh = &state;
+    level.geom = geom;
+    interpolate_rhs_from_mesh(neutrinos_rhs, Vector<ParticleMeshLevel>{level}, parms);
+}
 
-        // set the dfdt values into p.rdata
-        p.rdata(PIdx::x) = p.rdata(PIdx::pupx) / p.rdata(PIdx::pupt) * PhysConst::c;
-        p.rdata(PIdx::y) = p.rdata(PIdx::pupy) / p.rdata(PIdx::pupt) * PhysConst::c;
-        p.rdata(PIdx::z) = p.rdata(PIdx::pupz) / p.rdata(PIdx::pupt) * PhysConst::c;
+template<int NF>
+void interpolate_rhs_from_mesh(FlavoredNeutrinoContainer<NF>& neutrinos_rhs, const Vector<ParticleMeshLevel>& levels, const TestParams* parms)
+{
+    BL_PROFILE("interpolate_rhs_from_mesh");
+
+    // the potential and f are stored for neutrinos, then antineutrinos, for each realization
+    using FlavorMatrix = HermitianMatrix<NF>;
+    using PIdx = ::PIdx<NF>;
+    using ParticleType = typename FlavoredNeutrinoContainer<NF>::ParticleType;
+    constexpr int ncomp_V = 2*FlavorMatrix::ncomp;
+    constexpr int realization_nattribs = ::realization_nattribs<NF>;
+    static_assert(PIdx::Nbar == PIdx::f00_Re + FlavorMatrix::ncomp, "f must be contiguous in the particle data");
+    const amrex::Real inv_hbar = 1.0/PhysConst::hbar;
+    const FlavorMatrix M2 = flavor_mass_matrix<NF>(parms);
+
+    // set the rhs of everything but the flavor into p.rdata
+    auto set_transport_rhs = [=] AMREX_GPU_HOST_DEVICE (ParticleType& p)
+    {
+        const amrex::Real c_over_pupt = PhysConst::c / p.rdata(PIdx::pupt);
+        p.rdata(PIdx::x) = p.rdata(PIdx::pupx) * c_over_pupt;
+        p.rdata(PIdx::y) = p.rdata(PIdx::pupy) * c_over_pupt;
+        p.rdata(PIdx::z) = p.rdata(PIdx::pupz) * c_over_pupt;
         p.rdata(PIdx::time) = 1.0; // neutrinos move at one second per second!
         p.rdata(PIdx::pupx) = 0;
         p.rdata(PIdx::pupy) = 0;
         p.rdata(PIdx::pupz) = 0;
         p.rdata(PIdx::pupt) = 0;
-        p.rdata(PIdx::N) = 0;
-        p.rdata(PIdx::Nbar) = 0;
-        p.rdata(PIdx::L) = 0;
-        p.rdata(PIdx::Lbar) = 0;
+        for (int r = 0; r < NUM_REALIZATIONS; ++r) {
+            const RealizationParticle<NF, ParticleType> pr(p, r);
+            pr.rdata(PIdx::N) = 0;
+            pr.rdata(PIdx::Nbar) = 0;
+            pr.rdata(PIdx::L) = 0;
+            pr.rdata(PIdx::Lbar) = 0;
+            // the background diagonals are the last attributes of a realization
+            for (int n = PIdx::f00_Re_bg; n < PIdx::nattribs_one_realization; ++n) pr.rdata(n) = 0;
+        }
+    };
+
+    // the masks select exactly one level for each particle, which is advanced in place
+    for (const ParticleMeshLevel& level : levels) {
+        const Geometry& geom = level.geom;
+        const auto plo = geom.ProbLoArray();
+        const auto dxi = geom.InvCellSizeArray();
+        const Real inv_cell_volume = dxi[0]*dxi[1]*dxi[2];
+        const Real sqrt2GF_inv_cell_volume = M_SQRT2*PhysConst::GF*inv_cell_volume;
+        const Real cell_volume_over_Mp = 1.0/(inv_cell_volume*PhysConst::Mp);
+
+        const int shape_factor_order_x = geom.Domain().length(0) > 1 ? SHAPE_FACTOR_ORDER : 0;
+        const int shape_factor_order_y = geom.Domain().length(1) > 1 ? SHAPE_FACTOR_ORDER : 0;
+        const int shape_factor_order_z = geom.Domain().length(2) > 1 ? SHAPE_FACTOR_ORDER : 0;
+
+        // with a single cell every particle sees the same mesh values
+        const bool homogeneous = geom.Domain().numPts() == 1;
+        const auto domain_lo = amrex::lbound(geom.Domain());
+
+        // potential (vacuum, matter and self-interaction) seen by each realization of a
+        // particle, stored in V starting at r*ncomp_V. The shape factors are shared, and
+        // only computed if the domain has more than one cell.
+        auto interpolate_potential = [=] AMREX_GPU_HOST_DEVICE (const ParticleType& particle,
+                                                               amrex::Array4<const amrex::Real> const& mesh,
+                                                               amrex::Real* V_realizations)
+        {
+            if (homogeneous) {
+                for (int r = 0; r < NUM_REALIZATIONS; ++r) {
+                    const RealizationMesh<NF, const amrex::Real> sarr(mesh, r);
+                    FlavorPotential<NF> potential(particle);
+
+                    // read the single cell directly instead of looping over the stencil
+                    potential.AddCell(sarr, domain_lo.x, domain_lo.y, domain_lo.z, 1.0, cell_volume_over_Mp);
+                    potential.Store(M2, sqrt2GF_inv_cell_volume, &V_realizations[r*ncomp_V]);
+                }
+                return;
+            }
+
+            const amrex::Real delta_x = (particle.pos(0) - plo[0]) * dxi[0];
+            const amrex::Real delta_y = (particle.pos(1) - plo[1]) * dxi[1];
+            const amrex::Real delta_z = (particle.pos(2) - plo[2]) * dxi[2];
+
+            const ParticleInterpolator<SHAPE_FACTOR_ORDER> sx(delta_x, shape_factor_order_x);
+            const ParticleInterpolator<SHAPE_FACTOR_ORDER> sy(delta_y, shape_factor_order_y);
+            const ParticleInterpolator<SHAPE_FACTOR_ORDER> sz(delta_z, shape_factor_order_z);
+
+            for (int r = 0; r < NUM_REALIZATIONS; ++r) {
+                const RealizationMesh<NF, const amrex::Real> sarr(mesh, r);
+                FlavorPotential<NF> potential(particle);
+
+                for (int k = sz.first(); k <= sz.last(); ++k) {
+                    for (int j = sy.first(); j <= sy.last(); ++j) {
+                        const amrex::Real weight_jk = sy(j) * sz(k);
+                        for (int i = sx.first(); i <= sx.last(); ++i) {
+                            potential.AddCell(sarr, i, j, k, sx(i) * weight_jk, cell_volume_over_Mp);
+                        }
+                    }
+                }
+
+                potential.Store(M2, sqrt2GF_inv_cell_volume, &V_realizations[r*ncomp_V]);
+            }
+        };
+
+        // whether this level advances the particle: its cell on the level has mask 1
+        const bool use_mask = level.mask != nullptr;
+        auto on_level = [=] AMREX_GPU_HOST_DEVICE (const ParticleType& p,
+                                                  amrex::Array4<const int> const& mask) -> bool
+        {
+            if (!use_mask) return true;
+            const int i = static_cast<int>(std::floor((p.pos(0) - plo[0]) * dxi[0]));
+            const int j = static_cast<int>(std::floor((p.pos(1) - plo[1]) * dxi[1]));
+            const int k = static_cast<int>(std::floor((p.pos(2) - plo[2]) * dxi[2]));
+            return mask.contains(i,j,k) && mask(i,j,k) == 1;
+        };
+
+        const int lev = 0;
+
+#if defined(AMREX_USE_GPU) || (SIMD_WIDTH <= 1)
+#ifdef _OPENMP
+#pragma omp parallel if (Gpu::notInLaunchRegion())
+#endif
+        for (FNParIter<NF> pti(neutrinos_rhs, lev); pti.isValid(); ++pti)
+        {
+            const int index = level.box_index ? (*level.box_index)[pti.index()] : pti.index();
+            if (index < 0) continue;
 
-        #include "generated_files/Evolve.cpp_dfdt_fill"
-    });
+            const int np = pti.numParticles();
+            ParticleType* pstruct = &(pti.GetArrayOfStructs()[0]);
+            auto const& sarr = level.mesh->const_array(index);
+            const amrex::Array4<const int> mask = use_mask ? level.mask->const_array(index) : amrex::Array4<const int>();
+
+            amrex::ParallelFor(np, [=] AMREX_GPU_DEVICE (int ip)
+            {
+                ParticleType& p = pstruct[ip];
+                if (!on_level(p, mask)) return;
+
+                amrex::Real V[NUM_REALIZATIONS*ncomp_V];
+                interpolate_potential(p, sarr, V);
+                set_transport_rhs(p);
+
+                // set the dfdt values into p.rdata
+                const int f_start[2] = {PIdx::f00_Re, PIdx::f00_Rebar};
+                for (int r = 0; r < NUM_REALIZATIONS; ++r) {
+                    for (int tail = 0; tail < 2; ++tail) {
+                        FlavorMatrix H, f;
+                        H.load(&V[r*ncomp_V + tail*FlavorMatrix::ncomp]);
+                        f.load(&p.rdata(f_start[tail] + r*realization_nattribs));
+                        FlavorMatrix dfdt = FlavorMatrix::minus_i_commutator(H, f);
+                        dfdt *= inv_hbar;
+                        dfdt.store(&p.rdata(f_start[tail] + r*realization_nattribs));
+                    }
+                }
+            });
+        }
+#else
+        // The interpolation is done one particle at a time, but the potential and
+        // distribution function of SIMD_WIDTH particles are then transposed into
+        // lane-contiguous arrays so the commutator vectorizes across particles.
+        // f is stored contiguously in the particle data, starting at f00_Re and f00_Rebar.
+        // Each (realization, tail) pair is a block of FlavorMatrix::ncomp rows, and
+        // f of realization r starts realization_nattribs attributes after realization 0.
+        constexpr int nblocks = 2*NUM_REALIZATIONS;
+        const int f_start[2] = {PIdx::f00_Re, PIdx::f00_Rebar};
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+        for (FNParIter<NF> pti(neutrinos_rhs, lev); pti.isValid(); ++pti)
+        {
+            const int index = level.box_index ? (*level.box_index)[pti.index()] : pti.index();
+            if (index < 0) continue;
+
+            const int np = pti.numParticles();
+            ParticleType* pstruct = &(pti.GetArrayOfStructs()[0]);
+            auto const& sarr = level.mesh->const_array(index);
+            const amrex::Array4<const int> mask = use_mask ? level.mask->const_array(index) : amrex::Array4<const int>();
+
+            int next = 0;
+            while (next < np) {
+                // the next SIMD_WIDTH particles advanced by this level
+                int lanes[SIMD_WIDTH];
+                int nlanes = 0;
+                for (; next < np && nlanes < SIMD_WIDTH; ++next)
+                    if (on_level(pstruct[next], mask)) lanes[nlanes++] = next;
+
+                // unused lanes of the last batch stay zero
+                amrex::Real Vbatch[nblocks*FlavorMatrix::ncomp][SIMD_WIDTH] = {};
+                amrex::Real fbatch[nblocks*FlavorMatrix::ncomp][SIMD_WIDTH] = {};
+
+                for (int lane = 0; lane < nlanes; ++lane) {
+                    ParticleType& p = pstruct[lanes[lane]];
+                    amrex::Real V[NUM_REALIZATIONS*ncomp_V];
+                    interpolate_potential(p, sarr, V);
+                    for (int block = 0; block < nblocks; ++block) {
+                        const int f_first = f_start[block%2] + (block/2)*realization_nattribs;
+                        for (int icomp = 0; icomp < FlavorMatrix::ncomp; ++icomp) {
+                            Vbatch[block*FlavorMatrix::ncomp+icomp][lane] = V[block*FlavorMatrix::ncomp+icomp];
+                            fbatch[block*FlavorMatrix::ncomp+icomp][lane] = p.rdata(f_first+icomp);
+                        }
+                    }
+                    set_transport_rhs(p);
+                }
+
+                AMREX_PRAGMA_SIMD
+                for (int lane = 0; lane < SIMD_WIDTH; ++lane) {
+                    for (int block = 0; block < nblocks; ++block) {
+                        FlavorMatrix H, f;
+                        H.load(&Vbatch[block*FlavorMatrix::ncomp][lane], SIMD_WIDTH);
+                        f.load(&fbatch[block*FlavorMatrix::ncomp][lane], SIMD_WIDTH);
+                        FlavorMatrix dfdt = FlavorMatrix::minus_i_commutator(H, f);
+                        dfdt *= inv_hbar;
+                        dfdt.store(&fbatch[block*FlavorMatrix::ncomp][lane], SIMD_WIDTH);
+                    }
+                }
+
+                // set the dfdt values into p.rdata
+                for (int lane = 0; lane < nlanes; ++lane) {
+                    ParticleType& p = pstruct[lanes[lane]];
+                    for (int block = 0; block < nblocks; ++block) {
+                        const int f_first = f_start[block%2] + (block/2)*realization_nattribs;
+                        for (int icomp = 0; icomp < FlavorMatrix::ncomp; ++icomp)
+                            p.rdata(f_first+icomp) = fbatch[block*FlavorMatrix::ncomp+icomp][lane];
+                    }
+                }
+            }
+        }
+#endif
+    }
 }
+
+template struct GIdx<2>;
+template struct GIdx<3>;
+
+template Real compute_dt<2>(const Geometry&, Real, Real, Real, const ReductionAggregator&, const TimestepReductionSlots&);
+template Real compute_dt<3>(const Geometry&, Real, Real, Real, const ReductionAggregator&, const TimestepReductionSlots&);
+template Real compute_dt<2>(const Geometry&, Real, const LocalPotentialMax&, Real, Real);
+template Real compute_dt<3>(const Geometry&, Real, const LocalPotentialMax&, Real, Real);
+template BackgroundMoments compute_background_moments(const FlavoredNeutrinoContainer<2>&, const Geometry&);
+template BackgroundMoments compute_background_moments(const FlavoredNeutrinoContainer<3>&, const Geometry&);
+template void check_uniform_background(const FlavoredNeutrinoContainer<2>&, const MultiFab&, const Geometry&, const BackgroundMoments&, bool);
+template void check_uniform_background(const FlavoredNeutrinoContainer<3>&, const MultiFab&, const Geometry&, const BackgroundMoments&, bool);
+template void report_delta_f_noise(const FlavoredNeutrinoContainer<2>&, const MultiFab&, const Geometry&, const BackgroundMoments&, bool);
+template void report_delta_f_noise(const FlavoredNeutrinoContainer<3>&, const MultiFab&, const Geometry&, const BackgroundMoments&, bool);
+template void deposit_to_mesh(const FlavoredNeutrinoContainer<2>&, MultiFab&, const Geometry&, const BackgroundMoments&, bool);
+template void deposit_to_mesh(const FlavoredNeutrinoContainer<3>&, MultiFab&, const Geometry&, const BackgroundMoments&, bool);
+template void deposit_to_level(const FlavoredNeutrinoContainer<2>&, MultiFab&, const Vector<int>&, const Geometry&);
+template void deposit_to_level(const FlavoredNeutrinoContainer<3>&, MultiFab&, const Vector<int>&, const Geometry&);
+template void compute_local_potential_max<2>(const MultiFab&, const Geometry&, LocalPotentialMax&);
+template void compute_local_potential_max<3>(const MultiFab&, const Geometry&, LocalPotentialMax&);
+template HermitianMatrix<2> flavor_mass_matrix<2>(const TestParams*);
+template HermitianMatrix<3> flavor_mass_matrix<3>(const TestParams*);
+template void interpolate_rhs_from_mesh(FlavoredNeutrinoContainer<2>&, const MultiFab&, const Geometry&, const TestParams*);
+template void interpolate_rhs_from_mesh(FlavoredNeutrinoContainer<3>&, const MultiFab&, const Geometry&, const TestParams*);
+template void interpolate_rhs_from_mesh(FlavoredNeutrinoContainer<2>&, const Vector<ParticleMeshLevel>&, const TestParams*);
+template void interpolate_rhs_from_mesh(FlavoredNeutrinoContainer<3>&, const Vector<ParticleMeshLevel>&, const TestParams*);
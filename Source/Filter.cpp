@@ -0,0 +1,88 @@
+#include "Filter.H"
+#include "Evolve.H"
+#include <cmath>
+
+using namespace amrex;
+
+BinomialFilter::BinomialFilter(const Geometry& geom, const int a_npass, const bool a_compensate)
+    : npass(a_npass), compensate(a_compensate)
+{
+    AMREX_ALWAYS_ASSERT(npass >= 0);
+    for (int dir=0; dir<AMREX_SPACEDIM; dir++)
+        filter_direction[dir] = geom.Domain().length(dir) > 1;
+}
+
+Real BinomialFilter::TransferFunction(const Real theta) const
+{
+    const Real s2 = std::sin(0.5*theta) * std::sin(0.5*theta);
+    Real transfer = std::pow(1.0 - s2, npass);
+    if (compensate) transfer *= 1.0 + npass * s2;
+    return transfer;
+}
+
+void BinomialFilter::PrintTransferFunction() const
+{
+    amrex::Print() << "Filtering deposited moments with " << npass << " binomial passes"
+                   << (compensate ? " and compensation" : "") << " in directions ("
+                   << filter_direction[0] << "," << filter_direction[1] << "," << filter_direction[2] << ")" << std::endl;
+    amrex::Print() << "  wavelength (cells)    transfer function per direction" << std::endl;
+    for (const int ncells_per_wavelength : {2, 3, 4, 8, 16, 32, 64}) {
+        const Real theta = 2.0*M_PI/ncells_per_wavelength;
+        amrex::Print() << "  " << ncells_per_wavelength << "    " << TransferFunction(theta) << std::endl;
+    }
+}
+
+void BinomialFilter::Apply(MultiFab& state, const Geometry& geom) const
+{
+    BL_PROFILE("BinomialFilter::Apply");
+
+    for (int dir=0; dir<AMREX_SPACEDIM; dir++) {
+        if (!filter_direction[dir]) continue;
+
+        for (int pass=0; pass<npass; pass++)
+            ApplyStencil(state, geom, dir, 0.25, 0.5);
+
+        if (compensate && npass > 0)
+            ApplyStencil(state, geom, dir, -0.25*npass, 1.0 + 0.5*npass);
+    }
+
+    state.FillBoundary(geom.periodicity());
+}
+
+void BinomialFilter::ApplyStencil(MultiFab& state, const Geometry& geom, const int dir,
+                                  const Real w_side, const Real w_center) const
+{
+    // only filter the quantities set by the neutrinos, which follow the matter
+    // (rho, T, Ye) for any number of flavors
+    static_assert(GIdx<2>::N00_Re == GIdx<3>::N00_Re, "the matter must come first in the state");
+    const int start_comp = GIdx<2>::N00_Re;
+    const int num_comps = state.nComp() - start_comp;
+
+    // the stencil reads one ghost cell on each side
+    state.FillBoundary(geom.periodicity());
+
+    MultiFab filtered(state.boxArray(), state.DistributionMap(), num_comps, 0);
+
+    const IntVect shift = IntVect::TheDimensionVector(dir);
+
+#ifdef _OPENMP
+#pragma omp parallel if (Gpu::notInLaunchRegion())
+#endif
+    for (MFIter mfi(filtered, TilingIfNotGPU()); mfi.isValid(); ++mfi)
+    {
+        const Box& bx = mfi.tilebox();
+        auto const& sarr = state.const_array(mfi);
+        auto const& farr = filtered.array(mfi);
+
+        amrex::ParallelFor(bx, num_comps,
+        [=] AMREX_GPU_DEVICE (int i, int j, int k, int n)
+        {
+            const int comp = start_comp + n;
+            farr(i,j,k,n) = w_center * sarr(i,j,k,comp)
+                          + w_side * (sarr(i-shift[0], j-shift[1], k-shift[2], comp) +
+                                      sarr(i+shift[0], j+shift[1], k+shift[2], comp));
+        });
+    }
+
+    MultiFab::Copy(state, filtered, 0, start_comp, num_comps, 0);
+}
@@ -1,11 +1,13 @@
 #include "FlavoredNeutrinoContainer.H"
 #include "Constants.H"
+#include "Realizations.H"
 #include <sstream>
 #include <string>
 
 using namespace amrex;
 
-void FlavoredNeutrinoContainer::
+template<int NF>
+void FlavoredNeutrinoContainer<NF>::
 SyncLocation(int type)
 {
     BL_PROFILE("FlavoredNeutrinoContainer::SyncLocation");
@@ -17,7 +19,7 @@ SyncLocation(int type)
 #ifdef _OPENMP
 #pragma omp parallel
 #endif
-    for (FNParIter pti(*this, lev); pti.isValid(); ++pti)
+    for (FNParIter<NF> pti(*this, lev); pti.isValid(); ++pti)
     {
         const int np  = pti.numParticles();
         ParticleType* pstruct = &(pti.GetArrayOfStructs()[0]);
@@ -27,20 +29,21 @@ SyncLocation(int type)
 
             if (type == Sync::CoordinateToPosition) {
                 // Copy integrated position to the particle position.
-                p.pos(0) = p.rdata(PIdx::x);
-                p.pos(1) = p.rdata(PIdx::y);
-                p.pos(2) = p.rdata(PIdx::z);
+                p.pos(0) = p.rdata(PIdx<NF>::x);
+                p.pos(1) = p.rdata(PIdx<NF>::y);
+                p.pos(2) = p.rdata(PIdx<NF>::z);
             } else if (type == Sync::PositionToCoordinate) {
                 // Copy the reset particle position back to the integrated position.
-                p.rdata(PIdx::x) = p.pos(0);
-                p.rdata(PIdx::y) = p.pos(1);
-                p.rdata(PIdx::z) = p.pos(2);
+                p.rdata(PIdx<NF>::x) = p.pos(0);
+                p.rdata(PIdx<NF>::y) = p.pos(1);
+                p.rdata(PIdx<NF>::z) = p.pos(2);
             }
         });
     }
 }
 
-void FlavoredNeutrinoContainer::
+template<int NF>
+void FlavoredNeutrinoContainer<NF>::
 UpdateLocationFrom(FlavoredNeutrinoContainer& Ploc)
 {
     // This function updates particle locations in the current particle container
@@ -55,7 +58,7 @@ UpdateLocationFrom(FlavoredNeutrinoContainer& Ploc)
 #ifdef _OPENMP
 #pragma omp parallel
 #endif
-    for (FNParIter pti(*this, lev); pti.isValid(); ++pti)
+    for (FNParIter<NF> pti(*this, lev); pti.isValid(); ++pti)
     {
         auto grid_tile = pti.GetPairIndex();
 
@@ -86,28 +89,129 @@ UpdateLocationFrom(FlavoredNeutrinoContainer& Ploc)
     }
 }
 
-void FlavoredNeutrinoContainer::
+template<int NF>
+RenormalizeDiagnostics FlavoredNeutrinoContainer<NF>::
 Renormalize(const TestParams* parms)
 {
     BL_PROFILE("FlavoredNeutrinoContainer::Renormalize");
 
+    using FlavorMatrix = HermitianMatrix<NF>;
+
     const int lev = 0;
 
-    const auto dxi = Geom(lev).InvCellSizeArray();
-    const auto plo = Geom(lev).ProbLoArray();
+    const Real maxError = parms->maxError;
+
+    ReduceOps<ReduceOpMax, ReduceOpMax, ReduceOpMax, ReduceOpSum> reduce_op;
+    ReduceData<Real, Real, Real, Long> reduce_data(reduce_op);
+    using ReduceTuple = typename decltype(reduce_data)::Type;
 
 #ifdef _OPENMP
 #pragma omp parallel
 #endif
-    for (FNParIter pti(*this, lev); pti.isValid(); ++pti)
+    for (FNParIter<NF> pti(*this, lev); pti.isValid(); ++pti)
     {
         const int np  = pti.numParticles();
         ParticleType * pstruct = &(pti.GetArrayOfStructs()[0]);
 
-        amrex::ParallelFor (np, [=] AMREX_GPU_DEVICE (int i) {
-            ParticleType& p = pstruct[i];
-            Real sumP, length, error;
-            #include "generated_files/FlavoredNeutrinoContainer.cpp_Renormalize_fill"
+        reduce_op.eval(np, reduce_data,
+        [=] AMREX_GPU_DEVICE (int i) -> ReduceTuple {
+            // The corrections are selects rather than branches so the kernel
+            // vectorizes, and the errors are checked on the host after the reduction.
+            Real max_trace_error = 0, max_length_error = 0, max_negative_diagonal = 0;
+            Long n_clamped_diagonals = 0;
+            const int f_start[2] = {PIdx<NF>::f00_Re, PIdx<NF>::f00_Rebar};
+            const int L_index[2] = {PIdx<NF>::L, PIdx<NF>::Lbar};
+            for (int r = 0; r < NUM_REALIZATIONS; ++r) {
+                const RealizationParticle<NF, ParticleType> p(pstruct[i], r);
+                for (int tail = 0; tail < 2; ++tail) {
+                    FlavorMatrix f;
+                    for (int n = 0; n < FlavorMatrix::ncomp; ++n) f.c[n] = p.rdata(f_start[tail] + n);
+
+                    // make sure the trace is 1
+                    Real error = f.trace() - 1.0;
+                    max_trace_error = amrex::max(max_trace_error, std::abs(error));
+                    const Real correction = std::abs(error) > maxError ? error/NF : 0.0;
+                    for (int a = 0; a < NF; ++a) f.c[FlavorMatrix::Re(a,a)] -= correction;
+
+                    // make sure diagonals are positive
+                    for (int a = 0; a < NF; ++a) {
+                        Real& fii = f.c[FlavorMatrix::Re(a,a)];
+                        max_negative_diagonal = amrex::max(max_negative_diagonal, -fii);
+                        n_clamped_diagonals += fii < -maxError;
+                        fii = fii < -maxError ? 0.0 : fii;
+                    }
+
+                    // make sure the flavor vector length is what it would be with a 1 in only one diagonal
+                    const Real target_length = p.rdata(L_index[tail]);
+                    const Real length = std::sqrt(f.SU_vector_magnitude2());
+                    error = length - target_length;
+                    max_length_error = amrex::max(max_length_error, std::abs(error));
+                    f *= std::abs(error) > maxError ? target_length/length : 1.0;
+
+                    for (int n = 0; n < FlavorMatrix::ncomp; ++n) p.rdata(f_start[tail] + n) = f.c[n];
+                }
+            }
+            return {max_trace_error, max_length_error, max_negative_diagonal, n_clamped_diagonals};
         });
     }
+
+    auto rv = reduce_data.value();
+
+    RenormalizeDiagnostics diagnostics;
+    diagnostics.max_trace_error       = amrex::get<0>(rv);
+    diagnostics.max_length_error      = amrex::get<1>(rv);
+    diagnostics.max_negative_diagonal = amrex::get<2>(rv);
+    diagnostics.n_clamped_diagonals   = amrex::get<3>(rv);
+    return diagnostics;
+}
+
+template class FlavoredNeutrinoContainer<2>;
+template class FlavoredNeutrinoContainer<3>;
+
+void RenormalizeDiagnostics::
+Queue(ReductionAggregator& reductions)
+{
+    slots[0] = reductions.AddMax(max_trace_error);
+    slots[1] = reductions.AddMax(max_length_error);
+    slots[2] = reductions.AddMax(max_negative_diagonal);
+    slots[3] = reductions.AddSum(n_clamped_diagonals);
+}
+
+void RenormalizeDiagnostics::
+Collect(const ReductionAggregator& reductions)
+{
+    max_trace_error       = reductions.Max(slots[0]);
+    max_length_error      = reductions.Max(slots[1]);
+    max_negative_diagonal = reductions.Max(slots[2]);
+    n_clamped_diagonals   = reductions.Sum(slots[3]);
+}
+
+void RenormalizeDiagnostics::
+Check(const TestParams* parms) const
+{
+    if (max_trace_error > parms->maxError ||
+        max_length_error > parms->maxError ||
+        n_clamped_diagonals > 0) {
+        amrex::Print() << "  Renormalized: max trace error = " << max_trace_error
+                       << ", max length error = " << max_length_error
+                       << ", clamped diagonals = " << static_cast<Long>(n_clamped_diagonals) << std::endl;
+    }
+
+    if (max_trace_error > 100.*parms->maxError) {
+        std::ostringstream Convert;
+        Convert << "Matrix trace (SumP) is not equal to 1, trace error exceeds 100*maxError: " << max_trace_error << " > " << 100.*parms->maxError;
+        amrex::Error(Convert.str());
+    }
+
+    if (max_negative_diagonal > 100.*parms->maxError) {
+        std::ostringstream Convert;
+        Convert << "Diagonal element is negative, less than -100*maxError: " << -max_negative_diagonal << " < " << -100.*parms->maxError;
+        amrex::Error(Convert.str());
+    }
+
+    if (max_length_error > 100.*parms->maxError) {
+        std::ostringstream Convert;
+        Convert << "flavor vector length differs from target length by more than 100*maxError: " << max_length_error << " > " << 100.*parms->maxError;
+        amrex::Error(Convert.str());
+    }
 }
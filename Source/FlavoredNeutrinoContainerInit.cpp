@@ -1,84 +1,14 @@
 #include "FlavoredNeutrinoContainer.H"
+#include "DirectionSets.H"
+#include "AngularDecomposition.H"
+#include "HermitianMatrix.H"
+#include "Realizations.H"
+#include "Stability.H"
  #include "Constants.H"
 #include <random>
 
 using namespace amrex;
 
-// generate an array of theta,phi pairs that uniformily cover the surface of a sphere
-// based on DOI: 10.1080/10586458.2003.10504492 section 3.3 but specifying n_j=0 instead of n
-Gpu::ManagedVector<GpuArray<Real,3> > uniform_sphere_xyz(int nphi_at_equator){
-	AMREX_ASSERT(nphi_at_equator>0);
-	
-	Real dtheta = M_PI*std::sqrt(3)/nphi_at_equator;
-
-	Gpu::ManagedVector<GpuArray<Real,3> > xyz;
-	Real theta = 0;
-	Real phi0 = 0;
-	while(theta < M_PI/2.){
-		int nphi = theta==0 ? nphi_at_equator : lround(nphi_at_equator * std::cos(theta));
-		Real dphi = 2.*M_PI/nphi;
-		if(nphi==1) theta = M_PI/2.;
-
-		for(int iphi=0; iphi<nphi; iphi++){
-			Real phi = phi0 + iphi*dphi;
-			Real x = std::cos(theta) * std::cos(phi);
-			Real y = std::cos(theta) * std::sin(phi);
-			Real z = std::sin(theta);
-			xyz.push_back(GpuArray<Real,3>{x,y,z});
-			// construct exactly opposing vectors to limit subtractive cancellation errors
-			// and be able to represent isotropy exactly (all odd moments == 0)
-			if(theta>0) xyz.push_back(GpuArray<Real,3>{-x,-y,-z});
-		}
-		theta += dtheta;
-		phi0 = phi0 + 0.5*dphi; // offset by half step so adjacent latitudes are not always aligned in longitude
-	}
-
-	return xyz;
-}
-
-// residual for the root finder
-// Z needs to be bigger if residual is positive
-// Minerbo (1978) (unfortunately under Elsevier paywall)
-// Can also see Richers (2020) https://ui.adsabs.harvard.edu/abs/2020PhRvD.102h3017R
-//     Eq.41 (where a is Z), but in the non-degenerate limit
-//     k->0, eta->0, N->Z/(4pi sinh(Z)) (just to make it integrate to 1)
-//     minerbo_residual is the "f" equation between eq.42 and 43
-Real minerbo_residual(const Real fluxfac, const Real Z){
-	return fluxfac - 1.0/std::tanh(Z) + 1.0 / Z;
-}
-Real minerbo_residual_derivative(const Real fluxfac, const Real Z){
-	return 1.0/(std::sinh(Z)*std::sinh(Z)) - 1.0/(Z*Z);
-}
-Real minerbo_Z(const Real fluxfac){
-	// hard-code in these parameters because they are not
-	// really very important...
-	Real maxresidual = 1e-6;
-	Real maxcount = 20;
-	Real minfluxfac = 1e-3;
-
-	// set the initial conditions
-	Real Z = 1.0;
-
-	// catch the small flux factor case to prevent nans
-	if(fluxfac < minfluxfac)
-		Z = 3.*fluxfac;
-	else{
-		Real residual = 1.0;
-		int count = 0;
-		while(std::abs(residual)>maxresidual and count<maxcount){
-			residual = minerbo_residual(fluxfac, Z);
-			Real slope = minerbo_residual_derivative(fluxfac, Z);
-			Z -= residual/slope;
-			count++;
-		}
-		if(residual>maxresidual)
-			amrex::Error("Failed to converge on a solution.");
-	}
-	
-	amrex::Print() << "fluxfac="<<fluxfac<<" Z=" << Z<<std::endl;
-	return Z;
-}
-
 namespace
 {    
     AMREX_GPU_HOST_DEVICE void get_position_unit_cell(Real* r, const IntVect& nppc, int i_part)
@@ -122,38 +52,107 @@ namespace
 	if(Z/3.0 > minfluxfac)
 		*result *= Z/std::sinh(Z);
   }
+
+// set f and fbar to a 1 in diagonal a and zero elsewhere
+  template<int NF, typename P>
+  AMREX_GPU_HOST_DEVICE void set_pure_flavor(P& p, const int a){
+    using FlavorMatrix = HermitianMatrix<NF>;
+    for(int n=0; n<FlavorMatrix::ncomp; n++){
+      p.rdata(PIdx<NF>::f00_Re    + n) = 0.0;
+      p.rdata(PIdx<NF>::f00_Rebar + n) = 0.0;
+    }
+    p.rdata(PIdx<NF>::f00_Re    + FlavorMatrix::Re(a,a)) = 1.0;
+    p.rdata(PIdx<NF>::f00_Rebar + FlavorMatrix::Re(a,a)) = 1.0;
+  }
+
+// set the real and then the imaginary part of the off-diagonal ab (a<b) of
+// f (tail 0) or fbar (tail 1) to amplitude times a random number in [-1,1)
+  template<int NF, typename P>
+  AMREX_GPU_HOST_DEVICE void perturb_offdiagonal(P& p, const int tail, const int a, const int b, const Real amplitude){
+    using FlavorMatrix = HermitianMatrix<NF>;
+    const int f = tail==0 ? PIdx<NF>::f00_Re : PIdx<NF>::f00_Rebar;
+    Real rand;
+    symmetric_uniform(&rand);
+    p.rdata(f+FlavorMatrix::Re(a,b)) = amplitude*rand;
+    symmetric_uniform(&rand);
+    p.rdata(f+FlavorMatrix::Im(a,b)) = amplitude*rand;
+  }
+
+// draw new random off-diagonals for another realization of a particle,
+// keeping its diagonals. As in InitParticles, simulation_type 4 only
+// perturbs the first row and simulation_type 5 scales the perturbation
+// by the difference of the diagonals.
+  template<int NF, typename P>
+  AMREX_GPU_HOST_DEVICE void perturb_realization(P& p, const TestParams* parms){
+    using FlavorMatrix = HermitianMatrix<NF>;
+    const int f_start[2] = {PIdx<NF>::f00_Re, PIdx<NF>::f00_Rebar};
+    for(int tail=0; tail<2; tail++){
+      const int f = f_start[tail];
+      for(int a=0; a<NF; a++){
+        for(int b=a+1; b<NF; b++){
+          Real amplitude = 0;
+          if(parms->simulation_type==4)
+            amplitude = a==0 ? parms->st4_amplitude : 0;
+          else if(parms->simulation_type==5)
+            amplitude = parms->st5_amplitude * (p.rdata(f+FlavorMatrix::Re(a,a)) - p.rdata(f+FlavorMatrix::Re(b,b)));
+          perturb_offdiagonal<NF>(p, tail, a, b, amplitude);
+        }
+      }
+    }
+  }
 }
 
-FlavoredNeutrinoContainer::
+template<int NF>
+FlavoredNeutrinoContainer<NF>::
 FlavoredNeutrinoContainer(const Geometry            & a_geom,
                           const DistributionMapping & a_dmap,
                           const BoxArray            & a_ba)
-    : ParticleContainer<PIdx::nattribs, 0, 0, 0>(a_geom, a_dmap, a_ba)
+    : ParticleContainer<PIdx<NF>::nattribs, 0, 0, 0>(a_geom, a_dmap, a_ba)
 {
-    #include "generated_files/FlavoredNeutrinoContainerInit.H_particle_varnames_fill"
+    attribute_names = {"time", "x", "y", "z", "pupx", "pupy", "pupz", "pupt"};
+    for (const std::string tail : {"", "bar"}) {
+        attribute_names.push_back("N"+tail);
+        attribute_names.push_back("L"+tail);
+        for (const std::string& name : HermitianMatrix<NF>::names("f", tail))
+            attribute_names.push_back(name);
+    }
+    for (const std::string tail : {"", "bar"})
+        for (int a = 0; a < NF; ++a)
+            attribute_names.push_back("f" + std::to_string(a) + std::to_string(a) + "_Re" + tail + "_bg");
+
+    // the flavor states of the other realizations are suffixed with their index
+    for (int r = 1; r < NUM_REALIZATIONS; ++r)
+        for (int n = PIdx<NF>::N; n < PIdx<NF>::nattribs_one_realization; ++n)
+            attribute_names.push_back(attribute_names[n] + "_r" + std::to_string(r));
 }
 
+template<int NF>
 void
-FlavoredNeutrinoContainer::
+FlavoredNeutrinoContainer<NF>::
 InitParticles(const TestParams* parms)
 {
     BL_PROFILE("FlavoredNeutrinoContainer::InitParticles");
 
+    using PIdx = ::PIdx<NF>;
+    using FlavorMatrix = HermitianMatrix<NF>;
+
     const int lev = 0;   
-    const auto dx = Geom(lev).CellSizeArray();
-    const auto plo = Geom(lev).ProbLoArray();
-    const auto& a_bounds = Geom(lev).ProbDomain();
+    const auto dx = this->Geom(lev).CellSizeArray();
+    const auto plo = this->Geom(lev).ProbLoArray();
+    const auto& a_bounds = this->Geom(lev).ProbDomain();
     
     const int nlocs_per_cell = AMREX_D_TERM( parms->nppc[0],
                                      *parms->nppc[1],
                                      *parms->nppc[2]);
     
-    Gpu::ManagedVector<GpuArray<Real,3> > direction_vectors = uniform_sphere_xyz(parms->nphi_equator);
-    auto* direction_vectors_p = direction_vectors.dataPtr();
-    int ndirs_per_loc = direction_vectors.size();
-    amrex::Print() << "Using " << ndirs_per_loc << " directions based on " << parms->nphi_equator << " directions at the equator." << std::endl;
+    DirectionSet directions = make_direction_set(parms);
+    if (parms->angular_decomposition) directions = owned_directions(directions);
+    auto* direction_vectors_p = directions.xyz.dataPtr();
+    auto* direction_weights_p = directions.weight.dataPtr();
+    int ndirs_per_loc = directions.size();
 
-    const Real scale_fac = dx[0]*dx[1]*dx[2]/nlocs_per_cell/ndirs_per_loc;
+    // each particle carries the fraction of the cell volume given by its location and direction weight
+    const Real volume_per_loc = dx[0]*dx[1]*dx[2]/nlocs_per_cell;
 
 	// get the Z parameters for the Minerbo closure if using simuation type 5
 	Real Ze, Za, Zx;
@@ -174,12 +173,15 @@ InitParticles(const TestParams* parms)
 		Ze = minerbo_Z(fluxfac_e);
 		Za = minerbo_Z(fluxfac_a);
 		Zx = minerbo_Z(fluxfac_x);
+		amrex::Print() << "fluxfac="<<fluxfac_e<<" Z=" << Ze<<std::endl;
+		amrex::Print() << "fluxfac="<<fluxfac_a<<" Z=" << Za<<std::endl;
+		amrex::Print() << "fluxfac="<<fluxfac_x<<" Z=" << Zx<<std::endl;
 	}
 
 #ifdef _OPENMP
 #pragma omp parallel
 #endif
-    for (MFIter mfi = MakeMFIter(lev); mfi.isValid(); ++mfi)
+    for (MFIter mfi = this->MakeMFIter(lev); mfi.isValid(); ++mfi)
     {
         const Box& tile_box  = mfi.tilebox();
 
@@ -238,7 +240,7 @@ InitParticles(const TestParams* parms)
         #endif
         {
 
-        	auto& particles = GetParticles(lev);
+        	auto& particles = this->GetParticles(lev);
         	auto& particle_tile = particles[std::make_pair(mfi.index(), mfi.LocalTileIndex())];
 
         	// Resize the particle container
@@ -257,7 +259,7 @@ InitParticles(const TestParams* parms)
 
         int procID = ParallelDescriptor::MyProc();
 
-	Real domain_length_z = Geom(lev).ProbLength(2);
+	Real domain_length_z = this->Geom(lev).ProbLength(2);
 
         // Initialize particle data in the particle tile
         amrex::ParallelFor(tile_box,
@@ -313,6 +315,7 @@ InitParticles(const TestParams* parms)
                     p.rdata(PIdx::time) = 0;
 
                     const GpuArray<Real,3> u = direction_vectors_p[i_direction];
+                    const Real scale_fac = volume_per_loc * direction_weights_p[i_direction];
                     //get_random_direction(u);
 
 		//=========================//
@@ -322,32 +325,11 @@ InitParticles(const TestParams* parms)
 		  // set all particles to start in electron state (and anti-state)
 		  // Set N to be small enough that self-interaction is not important
 		  // Set all particle momenta to be such that one oscillation wavelength is 1cm
-		  AMREX_ASSERT(NUM_FLAVORS==3 or NUM_FLAVORS==2);
 
 		  // Set particle flavor
 		  p.rdata(PIdx::N) = 1.0;
 		  p.rdata(PIdx::Nbar) = 1.0;
-		  p.rdata(PIdx::f00_Re)    = 1.0;
-		  p.rdata(PIdx::f01_Re)    = 0.0;
-		  p.rdata(PIdx::f01_Im)    = 0.0;
-		  p.rdata(PIdx::f11_Re)    = 0.0;
-		  p.rdata(PIdx::f00_Rebar) = 1.0;
-		  p.rdata(PIdx::f01_Rebar) = 0.0;
-		  p.rdata(PIdx::f01_Imbar) = 0.0;
-		  p.rdata(PIdx::f11_Rebar) = 0.0;
-
-#if (NUM_FLAVORS==3)
-		  p.rdata(PIdx::f22_Re)    = 0.0;
-		  p.rdata(PIdx::f22_Rebar) = 0.0;
-		  p.rdata(PIdx::f02_Re)    = 0.0;
-		  p.rdata(PIdx::f02_Im)    = 0.0;
-		  p.rdata(PIdx::f12_Re)    = 0.0;
-		  p.rdata(PIdx::f12_Im)    = 0.0;
-		  p.rdata(PIdx::f02_Rebar) = 0.0;
-		  p.rdata(PIdx::f02_Imbar) = 0.0;
-		  p.rdata(PIdx::f12_Rebar) = 0.0;
-		  p.rdata(PIdx::f12_Imbar) = 0.0;
-#endif
+		  set_pure_flavor<NF>(p, 0);
 
 		  // set momentum so that a vacuum oscillation wavelength occurs over a distance of 1cm
 		  // Set particle velocity to c in a random direction
@@ -362,30 +344,8 @@ InitParticles(const TestParams* parms)
 		// BIPOLAR OSCILLATION TEST //
 		//==========================//
 		else if(parms->simulation_type==1){
-		  AMREX_ASSERT(NUM_FLAVORS==3 or NUM_FLAVORS==2);
-		  
 		  // Set particle flavor
-		  p.rdata(PIdx::f00_Re)    = 1.0;
-		  p.rdata(PIdx::f01_Re)    = 0.0;
-		  p.rdata(PIdx::f01_Im)    = 0.0;
-		  p.rdata(PIdx::f11_Re)    = 0.0;
-		  p.rdata(PIdx::f00_Rebar) = 1.0;
-		  p.rdata(PIdx::f01_Rebar) = 0.0;
-		  p.rdata(PIdx::f01_Imbar) = 0.0;
-		  p.rdata(PIdx::f11_Rebar) = 0.0;
-
-#if (NUM_FLAVORS==3)
-		  p.rdata(PIdx::f22_Re)    = 0.0;
-		  p.rdata(PIdx::f22_Rebar) = 0.0;
-		  p.rdata(PIdx::f02_Re)    = 0.0;
-		  p.rdata(PIdx::f02_Im)    = 0.0;
-		  p.rdata(PIdx::f12_Re)    = 0.0;
-		  p.rdata(PIdx::f12_Im)    = 0.0;
-		  p.rdata(PIdx::f02_Rebar) = 0.0;
-		  p.rdata(PIdx::f02_Imbar) = 0.0;
-		  p.rdata(PIdx::f12_Rebar) = 0.0;
-		  p.rdata(PIdx::f12_Imbar) = 0.0;
-#endif
+		  set_pure_flavor<NF>(p, 0);
 
 		  // set energy to 50 MeV to match Richers+(2019)
 		  p.rdata(PIdx::pupt) = 50. * 1e6*CGSUnitsConst::eV;
@@ -407,30 +367,8 @@ InitParticles(const TestParams* parms)
 		// 2-BEAM FAST FLAVOR TEST//
 		//========================//
 		else if(parms->simulation_type==2){
-		  AMREX_ASSERT(NUM_FLAVORS==3 or NUM_FLAVORS==2);
-		  
 		  // Set particle flavor
-		  p.rdata(PIdx::f00_Re)    = 1.0;
-		  p.rdata(PIdx::f01_Re)    = 0.0;
-		  p.rdata(PIdx::f01_Im)    = 0.0;
-		  p.rdata(PIdx::f11_Re)    = 0.0;
-		  p.rdata(PIdx::f00_Rebar) = 1.0;
-		  p.rdata(PIdx::f01_Rebar) = 0.0;
-		  p.rdata(PIdx::f01_Imbar) = 0.0;
-		  p.rdata(PIdx::f11_Rebar) = 0.0;
-
-#if (NUM_FLAVORS==3)
-		  p.rdata(PIdx::f22_Re)    = 0.0;
-		  p.rdata(PIdx::f22_Rebar) = 0.0;
-		  p.rdata(PIdx::f02_Re)    = 0.0;
-		  p.rdata(PIdx::f02_Im)    = 0.0;
-		  p.rdata(PIdx::f12_Re)    = 0.0;
-		  p.rdata(PIdx::f12_Im)    = 0.0;
-		  p.rdata(PIdx::f02_Rebar) = 0.0;
-		  p.rdata(PIdx::f02_Imbar) = 0.0;
-		  p.rdata(PIdx::f12_Rebar) = 0.0;
-		  p.rdata(PIdx::f12_Imbar) = 0.0;
-#endif
+		  set_pure_flavor<NF>(p, 0);
 
 		  // set energy to 50 MeV to match Richers+(2019)
 		  p.rdata(PIdx::pupt) = 50. * 1e6*CGSUnitsConst::eV;
@@ -453,35 +391,15 @@ InitParticles(const TestParams* parms)
 		// 3- k!=0 BEAM FAST FLAVOR TEST //
 		//===============================//
 		else if(parms->simulation_type==3){
-		  AMREX_ASSERT(NUM_FLAVORS==3 or NUM_FLAVORS==2);
-
 		  // perturbation parameters
 		  Real lambda = domain_length_z/(Real)parms->st3_wavelength_fraction_of_domain;
 		  Real k = (2.*M_PI) / lambda;
 
 		  // Set particle flavor
-		  p.rdata(PIdx::f00_Re)    = 1.0;
-		  p.rdata(PIdx::f01_Re)    = parms->st3_amplitude*sin(k*p.pos(2));
-		  p.rdata(PIdx::f01_Im)    = 0.0;
-		  p.rdata(PIdx::f11_Re)    = 0.0;
-		  p.rdata(PIdx::f00_Rebar) = 1.0;
-		  p.rdata(PIdx::f01_Rebar) = parms->st3_amplitude*sin(k*p.pos(2));
-		  p.rdata(PIdx::f01_Imbar) = 0.0;
-		  p.rdata(PIdx::f11_Rebar) = 0.0;
-
-#if (NUM_FLAVORS==3) 
-		  //just perturbing the electron-muon flavor state, other terms can stay = 0.0 for simplicity
-		  p.rdata(PIdx::f22_Re)    = 0.0;
-		  p.rdata(PIdx::f22_Rebar) = 0.0;
-		  p.rdata(PIdx::f02_Re)    = 0.0; 
-		  p.rdata(PIdx::f02_Im)    = 0.0; 
-		  p.rdata(PIdx::f12_Re)    = 0.0;
-		  p.rdata(PIdx::f12_Im)    = 0.0;
-		  p.rdata(PIdx::f02_Rebar) = 0.0; 
-		  p.rdata(PIdx::f02_Imbar) = 0.0; 
-		  p.rdata(PIdx::f12_Rebar) = 0.0;
-		  p.rdata(PIdx::f12_Imbar) = 0.0;
-#endif
+		  // just perturbing the electron-muon flavor state, other terms can stay = 0.0 for simplicity
+		  set_pure_flavor<NF>(p, 0);
+		  p.rdata(PIdx::f00_Re    + FlavorMatrix::Re(0,1)) = parms->st3_amplitude*sin(k*p.pos(2));
+		  p.rdata(PIdx::f00_Rebar + FlavorMatrix::Re(0,1)) = parms->st3_amplitude*sin(k*p.pos(2));
 
 		  // set energy to 50 MeV to match Richers+(2019)
 		  p.rdata(PIdx::pupt) = 50. * 1e6*CGSUnitsConst::eV;
@@ -504,38 +422,12 @@ InitParticles(const TestParams* parms)
 		// 4- k!=0 RANDOMIZED //
 		//====================//
 		else if(parms->simulation_type==4){
-		  AMREX_ASSERT(NUM_FLAVORS==3 or NUM_FLAVORS==2);
-
-		  // Set particle flavor
-		  Real rand1, rand2, rand3, rand4;
-		  symmetric_uniform(&rand1);
-		  symmetric_uniform(&rand2);
-		  symmetric_uniform(&rand3);
-		  symmetric_uniform(&rand4);
-		  p.rdata(PIdx::f00_Re)    = 1.0;
-		  p.rdata(PIdx::f01_Re)    = parms->st4_amplitude*rand1;
-		  p.rdata(PIdx::f01_Im)    = parms->st4_amplitude*rand2;
-		  p.rdata(PIdx::f11_Re)    = 0.0;
-		  p.rdata(PIdx::f00_Rebar) = 1.0;
-		  p.rdata(PIdx::f01_Rebar) = parms->st4_amplitude*rand3;
-		  p.rdata(PIdx::f01_Imbar) = parms->st4_amplitude*rand4;
-		  p.rdata(PIdx::f11_Rebar) = 0.0;
-#if (NUM_FLAVORS==3)
-		  symmetric_uniform(&rand1);
-		  symmetric_uniform(&rand2);
-		  symmetric_uniform(&rand3);
-		  symmetric_uniform(&rand4);
-		  p.rdata(PIdx::f22_Re)    = 0.0;
-		  p.rdata(PIdx::f22_Rebar) = 0.0;
-		  p.rdata(PIdx::f02_Re)    = parms->st4_amplitude*rand1;
-		  p.rdata(PIdx::f02_Im)    = parms->st4_amplitude*rand2;
-		  p.rdata(PIdx::f12_Re)    = 0;
-		  p.rdata(PIdx::f12_Im)    = 0;
-		  p.rdata(PIdx::f02_Rebar) = parms->st4_amplitude*rand3;
-		  p.rdata(PIdx::f02_Imbar) = parms->st4_amplitude*rand4;
-		  p.rdata(PIdx::f12_Rebar) = 0;
-		  p.rdata(PIdx::f12_Imbar) = 0;
-#endif
+		  // Set particle flavor, with random perturbations to the first row
+		  set_pure_flavor<NF>(p, 0);
+		  for(int b=1; b<NF; b++){
+		    perturb_offdiagonal<NF>(p, 0, 0, b, parms->st4_amplitude);
+		    perturb_offdiagonal<NF>(p, 1, 0, b, parms->st4_amplitude);
+		  }
 
 		  // set energy to 50 MeV to match Richers+(2019)
 		  p.rdata(PIdx::pupt) = 50. * 1e6*CGSUnitsConst::eV;
@@ -572,8 +464,6 @@ InitParticles(const TestParams* parms)
 		// 5- Minerbo Closure //
 		//====================//
 		else if(parms->simulation_type==5){
-		  AMREX_ASSERT(NUM_FLAVORS==3 or NUM_FLAVORS==2);
-
 		  // set energy to 50 MeV
 		  p.rdata(PIdx::pupt) = 50. * 1e6*CGSUnitsConst::eV;
 		  p.rdata(PIdx::pupx) = u[0] * p.rdata(PIdx::pupt);
@@ -597,65 +487,77 @@ InitParticles(const TestParams* parms)
 		  Real Nnux_thisparticle = parms->st5_nnux*scale_fac * angular_factor / 4.0;
 
 		  // set total number of neutrinos the particle has as the sum of the flavors
-		  p.rdata(PIdx::N   ) = Nnue_thisparticle + Nnux_thisparticle;
-		  p.rdata(PIdx::Nbar) = Nnua_thisparticle + Nnux_thisparticle;
-#if NUM_FLAVORS==3
-		  p.rdata(PIdx::N   ) += Nnux_thisparticle;
-		  p.rdata(PIdx::Nbar) += Nnux_thisparticle;
-#endif
+		  p.rdata(PIdx::N   ) = Nnue_thisparticle + (NF-1)*Nnux_thisparticle;
+		  p.rdata(PIdx::Nbar) = Nnua_thisparticle + (NF-1)*Nnux_thisparticle;
 
 		  // set on-diagonals to have relative proportion of each flavor
+		  set_pure_flavor<NF>(p, 0);
 		  p.rdata(PIdx::f00_Re)    = Nnue_thisparticle / p.rdata(PIdx::N   );
-		  p.rdata(PIdx::f11_Re)    = Nnux_thisparticle / p.rdata(PIdx::N   );
 		  p.rdata(PIdx::f00_Rebar) = Nnua_thisparticle / p.rdata(PIdx::Nbar);
-		  p.rdata(PIdx::f11_Rebar) = Nnux_thisparticle / p.rdata(PIdx::Nbar);
-#if NUM_FLAVORS==3
-		  p.rdata(PIdx::f22_Re)    = Nnux_thisparticle / p.rdata(PIdx::N   );
-		  p.rdata(PIdx::f22_Rebar) = Nnux_thisparticle / p.rdata(PIdx::Nbar);
-#endif
-
-		  // random perturbations to the off-diagonals
-		  Real rand;
-		  symmetric_uniform(&rand);
-		  p.rdata(PIdx::f01_Re)    = parms->st5_amplitude*rand * (p.rdata(PIdx::f00_Re   ) - p.rdata(PIdx::f11_Re   ));
-		  symmetric_uniform(&rand);
-		  p.rdata(PIdx::f01_Im)    = parms->st5_amplitude*rand * (p.rdata(PIdx::f00_Re   ) - p.rdata(PIdx::f11_Re   ));
-		  symmetric_uniform(&rand);
-		  p.rdata(PIdx::f01_Rebar) = parms->st5_amplitude*rand * (p.rdata(PIdx::f00_Rebar) - p.rdata(PIdx::f11_Rebar));
-		  symmetric_uniform(&rand);
-		  p.rdata(PIdx::f01_Imbar) = parms->st5_amplitude*rand * (p.rdata(PIdx::f00_Rebar) - p.rdata(PIdx::f11_Rebar));
-#if NUM_FLAVORS==3
-		  symmetric_uniform(&rand);
-		  p.rdata(PIdx::f02_Re)    = parms->st5_amplitude*rand * (p.rdata(PIdx::f00_Re   ) - p.rdata(PIdx::f22_Re   ));
-		  symmetric_uniform(&rand);
-		  p.rdata(PIdx::f02_Im)    = parms->st5_amplitude*rand * (p.rdata(PIdx::f00_Re   ) - p.rdata(PIdx::f22_Re   ));
-		  symmetric_uniform(&rand);
-		  p.rdata(PIdx::f12_Re)    = parms->st5_amplitude*rand * (p.rdata(PIdx::f11_Re   ) - p.rdata(PIdx::f22_Re   ));
-		  symmetric_uniform(&rand);
-		  p.rdata(PIdx::f12_Im)    = parms->st5_amplitude*rand * (p.rdata(PIdx::f11_Re   ) - p.rdata(PIdx::f22_Re   ));
-		  symmetric_uniform(&rand);
-		  p.rdata(PIdx::f02_Rebar) = parms->st5_amplitude*rand * (p.rdata(PIdx::f00_Rebar) - p.rdata(PIdx::f22_Rebar));
-		  symmetric_uniform(&rand);
-		  p.rdata(PIdx::f02_Imbar) = parms->st5_amplitude*rand * (p.rdata(PIdx::f00_Rebar) - p.rdata(PIdx::f22_Rebar));
-		  symmetric_uniform(&rand);
-		  p.rdata(PIdx::f12_Rebar) = parms->st5_amplitude*rand * (p.rdata(PIdx::f11_Rebar) - p.rdata(PIdx::f22_Rebar));
-		  symmetric_uniform(&rand);
-		  p.rdata(PIdx::f12_Imbar) = parms->st5_amplitude*rand * (p.rdata(PIdx::f11_Rebar) - p.rdata(PIdx::f22_Rebar));
-#endif
+		  for(int a=1; a<NF; a++){
+		    p.rdata(PIdx::f00_Re    + FlavorMatrix::Re(a,a)) = Nnux_thisparticle / p.rdata(PIdx::N   );
+		    p.rdata(PIdx::f00_Rebar + FlavorMatrix::Re(a,a)) = Nnux_thisparticle / p.rdata(PIdx::Nbar);
+		  }
+
+		  // random perturbations to the off-diagonals, scaled by the difference of
+		  // the diagonals. The 01 component of both tails is drawn first.
+		  auto st5_perturb = [&] (int tail, int a, int b) {
+		    const int f = tail==0 ? PIdx::f00_Re : PIdx::f00_Rebar;
+		    perturb_offdiagonal<NF>(p, tail, a, b, parms->st5_amplitude * (p.rdata(f+FlavorMatrix::Re(a,a)) - p.rdata(f+FlavorMatrix::Re(b,b))));
+		  };
+		  st5_perturb(0, 0, 1);
+		  st5_perturb(1, 0, 1);
+		  for(int tail=0; tail<2; tail++)
+		    for(int a=0; a<NF; a++)
+		      for(int b=a+1; b<NF; b++)
+		        if(a>0 || b>1) st5_perturb(tail, a, b);
 		}
 
 		else{
             amrex::Error("Invalid simulation type");
 		}
 
-		#include "generated_files/FlavoredNeutrinoContainerInit.cpp_set_trace_length"
+		// the initial diagonal is the background distribution of the delta-f deposit
+		for (int a=0; a<NF; a++) {
+		  p.rdata(PIdx::f00_Re_bg    + a) = p.rdata(PIdx::f00_Re    + FlavorMatrix::Re(a,a));
+		  p.rdata(PIdx::f00_Rebar_bg + a) = p.rdata(PIdx::f00_Rebar + FlavorMatrix::Re(a,a));
+		}
+
+		// In the axisymmetric mode each particle stands for a whole ring of constant z.
+		// Its momentum is replaced by the azimuthal average, so the ring drifts along z
+		// and deposits no Fx or Fy.
+		if(parms->axisymmetric){
+		  p.rdata(PIdx::pupx) = 0;
+		  p.rdata(PIdx::pupy) = 0;
+		}
+
+		set_trace_length<NF>(p);
+
+		// the other realizations start from the same state with their own random perturbations
+		for(int r=1; r<NUM_REALIZATIONS; r++){
+		  for(int n=PIdx::N; n<PIdx::nattribs_one_realization; n++)
+		    p.rdata(n + r*realization_nattribs<NF>) = p.rdata(n);
+		  const RealizationParticle<NF, ParticleType> realization(p, r);
+		  perturb_realization<NF>(realization, parms);
+		  set_trace_length<NF>(realization);
+		}
             }
         }
         });
     }
 
     // get the minimum neutrino energy for calculating the timestep
-    Real pupt_min = amrex::ReduceMin(*this, [=] AMREX_GPU_DEVICE (const FlavoredNeutrinoContainer::ParticleType& p) -> Real { return p.rdata(PIdx::pupt); });
+    Real pupt_min = amrex::ReduceMin(*this, [=] AMREX_GPU_DEVICE (const ParticleType& p) -> Real { return p.rdata(PIdx<NF>::pupt); });
     ParallelDescriptor::ReduceRealMin(pupt_min);
-    #include "generated_files/FlavoredNeutrinoContainerInit.cpp_Vvac_fill"
+
+    // the largest vacuum potential, from the length of the mass matrix in the mass basis
+    HermitianMatrix<NF> M2_mass_basis;
+    const Real mass[3] = {parms->mass1, parms->mass2, parms->mass3};
+    for (int a=0; a<NF; a++) M2_mass_basis.c[HermitianMatrix<NF>::Re(a,a)] = mass[a]*mass[a];
+    Vvac_max = std::sqrt(M2_mass_basis.SU_vector_magnitude2())*PhysConst::c4/pupt_min;
 }
+
+template FlavoredNeutrinoContainer<2>::FlavoredNeutrinoContainer(const Geometry&, const DistributionMapping&, const BoxArray&);
+template FlavoredNeutrinoContainer<3>::FlavoredNeutrinoContainer(const Geometry&, const DistributionMapping&, const BoxArray&);
+template void FlavoredNeutrinoContainer<2>::InitParticles(const TestParams*);
+template void FlavoredNeutrinoContainer<3>::InitParticles(const TestParams*);
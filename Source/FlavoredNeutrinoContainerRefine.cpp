@@ -0,0 +1,436 @@
+#include "FlavoredNeutrinoContainer.H"
+#include "HermitianMatrix.H"
+#include "Constants.H"
+#include <cmath>
+#include <limits>
+#include <map>
+
+using namespace amrex;
+
+namespace
+{
+    template<int NF>
+    using FlavorMatrix = HermitianMatrix<NF>;
+    template<int NF>
+    using NeutrinoParticle = typename FlavoredNeutrinoContainer<NF>::ParticleType;
+    static_assert(PIdx<2>::f00_Rebar - PIdx<2>::f00_Re >= FlavorMatrix<2>::ncomp &&
+                  PIdx<3>::f00_Rebar - PIdx<3>::f00_Re >= FlavorMatrix<3>::ncomp,
+                  "the neutrino and antineutrino flavor matrices must not overlap");
+
+    // unit vector along the particle velocity and the particle speed in units of c
+    template<int NF>
+    void velocity_direction(const NeutrinoParticle<NF>& p, Real* u, Real& speed)
+    {
+        const Real inv_pupt = 1.0/p.rdata(PIdx<NF>::pupt);
+        u[0] = p.rdata(PIdx<NF>::pupx)*inv_pupt;
+        u[1] = p.rdata(PIdx<NF>::pupy)*inv_pupt;
+        u[2] = p.rdata(PIdx<NF>::pupz)*inv_pupt;
+        speed = std::sqrt(u[0]*u[0] + u[1]*u[1] + u[2]*u[2]);
+        if (speed > 0) for (int d=0; d<3; d++) u[d] /= speed;
+    }
+
+    // The particles of a cell that move in the same direction (to within a small
+    // fraction of angular_min_spacing_degrees) sample that direction at different
+    // positions. Refinement decisions are made per bundle, from the N-weighted
+    // flavor state of its members, so the angular spacing is the angle to the
+    // nearest other direction and never zero.
+    template<int NF>
+    struct DirectionBundle
+    {
+        Real u[3];
+        Vector<int> members;
+        Real f[FlavorMatrix<NF>::ncomp], fbar[FlavorMatrix<NF>::ncomp];
+    };
+
+    // N-weighted flavor states of the bundle members
+    template<int NF>
+    void bundle_flavor(DirectionBundle<NF>& bundle, const Gpu::HostVector<NeutrinoParticle<NF> >& particles)
+    {
+        Real N = 0, Nbar = 0;
+        for (int n=0; n<FlavorMatrix<NF>::ncomp; n++) bundle.f[n] = bundle.fbar[n] = 0;
+        for (const int i : bundle.members) {
+            const auto& p = particles[i];
+            N    += p.rdata(PIdx<NF>::N);
+            Nbar += p.rdata(PIdx<NF>::Nbar);
+            for (int n=0; n<FlavorMatrix<NF>::ncomp; n++) {
+                bundle.f[n]    += p.rdata(PIdx<NF>::N)   *p.rdata(PIdx<NF>::f00_Re    + n);
+                bundle.fbar[n] += p.rdata(PIdx<NF>::Nbar)*p.rdata(PIdx<NF>::f00_Rebar + n);
+            }
+        }
+        for (int n=0; n<FlavorMatrix<NF>::ncomp; n++) {
+            if (N    > 0) bundle.f[n]    /= N;
+            if (Nbar > 0) bundle.fbar[n] /= Nbar;
+        }
+    }
+
+    // Frobenius norm of the difference between the neutrino and antineutrino
+    // flavor matrices of two bundles
+    template<int NF>
+    Real flavor_difference(const DirectionBundle<NF>& a, const DirectionBundle<NF>& b)
+    {
+        Real diff2 = 0;
+        for (int n=0; n<FlavorMatrix<NF>::ncomp; n++) {
+            diff2 += (a.f[n]-b.f[n])*(a.f[n]-b.f[n]) + (a.fbar[n]-b.fbar[n])*(a.fbar[n]-b.fbar[n]);
+        }
+        return std::sqrt(diff2);
+    }
+
+    // Split p in place into a child along its direction and four children on a
+    // cone of half-angle alpha around it, all at the position of p with the same
+    // flavor state and a fifth of N and Nbar. N, Nbar and N*f are conserved. The
+    // cone children lose a factor cos(alpha) of their flux along the parent
+    // direction, so the flux of p is kept to a fraction 1 - 4/5 (1 - cos(alpha)).
+    // (No split into particles moving at c can conserve both N and F exactly.)
+    template<int NF>
+    void split(const NeutrinoParticle<NF>& p, const Real* u, const Real speed, const Real alpha,
+               Vector<NeutrinoParticle<NF> >& children)
+    {
+        // orthonormal basis (e1, e2) perpendicular to u
+        const int dmin = std::abs(u[0]) < std::abs(u[1]) ? (std::abs(u[0]) < std::abs(u[2]) ? 0 : 2)
+                                                        : (std::abs(u[1]) < std::abs(u[2]) ? 1 : 2);
+        Real e1[3] = {0,0,0};
+        e1[dmin] = 1;
+        const Real e1u = e1[0]*u[0] + e1[1]*u[1] + e1[2]*u[2];
+        for (int d=0; d<3; d++) e1[d] -= e1u*u[d];
+        const Real e1norm = std::sqrt(e1[0]*e1[0] + e1[1]*e1[1] + e1[2]*e1[2]);
+        for (int d=0; d<3; d++) e1[d] /= e1norm;
+        const Real e2[3] = {u[1]*e1[2] - u[2]*e1[1],
+                            u[2]*e1[0] - u[0]*e1[2],
+                            u[0]*e1[1] - u[1]*e1[0]};
+
+        const Real pmag = speed*p.rdata(PIdx<NF>::pupt);
+        for (int ichild=0; ichild<5; ichild++) {
+            // the first child keeps the parent direction
+            const Real theta = ichild == 0 ? 0 : alpha;
+            const Real phi = 0.5*M_PI*(ichild-1);
+            NeutrinoParticle<NF> child = p;
+            child.id()  = NeutrinoParticle<NF>::NextID();
+            child.cpu() = ParallelDescriptor::MyProc();
+            child.rdata(PIdx<NF>::pupx) = pmag*(std::cos(theta)*u[0] + std::sin(theta)*(std::cos(phi)*e1[0] + std::sin(phi)*e2[0]));
+            child.rdata(PIdx<NF>::pupy) = pmag*(std::cos(theta)*u[1] + std::sin(theta)*(std::cos(phi)*e1[1] + std::sin(phi)*e2[1]));
+            child.rdata(PIdx<NF>::pupz) = pmag*(std::cos(theta)*u[2] + std::sin(theta)*(std::cos(phi)*e1[2] + std::sin(phi)*e2[2]));
+            child.rdata(PIdx<NF>::N)    = 0.2*p.rdata(PIdx<NF>::N);
+            child.rdata(PIdx<NF>::Nbar) = 0.2*p.rdata(PIdx<NF>::Nbar);
+            children.push_back(child);
+        }
+    }
+
+    // Merge q into p so p carries the sum of N, Nbar, N*f and Nbar*fbar (and of
+    // the background diagonals), and
+    // invalidate q. The velocity and position of p become the (N+Nbar)-weighted
+    // averages, so p may move slower than c. The total flux is conserved whenever
+    // the two particles have the same N/Nbar.
+    template<int NF>
+    void merge_into(NeutrinoParticle<NF>& p, NeutrinoParticle<NF>& q)
+    {
+        const Real N    = p.rdata(PIdx<NF>::N)    + q.rdata(PIdx<NF>::N);
+        const Real Nbar = p.rdata(PIdx<NF>::Nbar) + q.rdata(PIdx<NF>::Nbar);
+        const Real wp = N + Nbar > 0 ? (p.rdata(PIdx<NF>::N) + p.rdata(PIdx<NF>::Nbar)) / (N + Nbar) : 0.5;
+        const Real wq = 1.0 - wp;
+
+        // an empty (anti)neutrino population keeps the flavor state of p
+        for (int n_comp=0; n_comp<FlavorMatrix<NF>::ncomp; n_comp++) {
+            if (N > 0)
+                p.rdata(PIdx<NF>::f00_Re + n_comp) = (p.rdata(PIdx<NF>::N)*p.rdata(PIdx<NF>::f00_Re + n_comp) +
+                                                  q.rdata(PIdx<NF>::N)*q.rdata(PIdx<NF>::f00_Re + n_comp)) / N;
+            if (Nbar > 0)
+                p.rdata(PIdx<NF>::f00_Rebar + n_comp) = (p.rdata(PIdx<NF>::Nbar)*p.rdata(PIdx<NF>::f00_Rebar + n_comp) +
+                                                     q.rdata(PIdx<NF>::Nbar)*q.rdata(PIdx<NF>::f00_Rebar + n_comp)) / Nbar;
+        }
+
+        for (int a=0; a<NF; a++) {
+            if (N > 0)
+                p.rdata(PIdx<NF>::f00_Re_bg + a) = (p.rdata(PIdx<NF>::N)*p.rdata(PIdx<NF>::f00_Re_bg + a) +
+                                                q.rdata(PIdx<NF>::N)*q.rdata(PIdx<NF>::f00_Re_bg + a)) / N;
+            if (Nbar > 0)
+                p.rdata(PIdx<NF>::f00_Rebar_bg + a) = (p.rdata(PIdx<NF>::Nbar)*p.rdata(PIdx<NF>::f00_Rebar_bg + a) +
+                                                   q.rdata(PIdx<NF>::Nbar)*q.rdata(PIdx<NF>::f00_Rebar_bg + a)) / Nbar;
+        }
+
+        const Real vx = wp*p.rdata(PIdx<NF>::pupx)/p.rdata(PIdx<NF>::pupt) + wq*q.rdata(PIdx<NF>::pupx)/q.rdata(PIdx<NF>::pupt);
+        const Real vy = wp*p.rdata(PIdx<NF>::pupy)/p.rdata(PIdx<NF>::pupt) + wq*q.rdata(PIdx<NF>::pupy)/q.rdata(PIdx<NF>::pupt);
+        const Real vz = wp*p.rdata(PIdx<NF>::pupz)/p.rdata(PIdx<NF>::pupt) + wq*q.rdata(PIdx<NF>::pupz)/q.rdata(PIdx<NF>::pupt);
+        p.rdata(PIdx<NF>::pupt) = wp*p.rdata(PIdx<NF>::pupt) + wq*q.rdata(PIdx<NF>::pupt);
+        p.rdata(PIdx<NF>::pupx) = vx*p.rdata(PIdx<NF>::pupt);
+        p.rdata(PIdx<NF>::pupy) = vy*p.rdata(PIdx<NF>::pupt);
+        p.rdata(PIdx<NF>::pupz) = vz*p.rdata(PIdx<NF>::pupt);
+
+        for (int d=0; d<AMREX_SPACEDIM; d++) p.pos(d) = wp*p.pos(d) + wq*q.pos(d);
+        p.rdata(PIdx<NF>::x) = p.pos(0);
+        p.rdata(PIdx<NF>::y) = p.pos(1);
+        p.rdata(PIdx<NF>::z) = p.pos(2);
+
+        p.rdata(PIdx<NF>::N)    = N;
+        p.rdata(PIdx<NF>::Nbar) = Nbar;
+
+        // the merged flavor state is mixed, so Renormalize must keep its shorter flavor vector
+        set_trace_length<NF>(p);
+
+        q.id() = -1;
+    }
+}
+
+template<int NF>
+void FlavoredNeutrinoContainer<NF>::
+AdaptAngularResolution(const TestParams* parms)
+{
+    BL_PROFILE("FlavoredNeutrinoContainer::AdaptAngularResolution");
+
+    using PIdx = ::PIdx<NF>;
+
+    const int lev = 0;
+    const auto plo = this->Geom(lev).ProbLoArray();
+    const auto dx  = this->Geom(lev).CellSizeArray();
+    const auto dxi = this->Geom(lev).InvCellSizeArray();
+
+    const Real min_spacing = parms->angular_min_spacing_degrees * M_PI/180.;
+    const Real max_spacing = parms->angular_max_spacing_degrees * M_PI/180.;
+    const Real cos_bundle_angle = std::cos(0.01*min_spacing);
+
+    // two particles are only merged if they are closer than half the initial
+    // distance between particle locations, so they sample the same position
+    // (positions along dimensions with a single cell do not matter)
+    Real merge_distance = std::numeric_limits<Real>::max();
+    bool resolved[AMREX_SPACEDIM];
+    for (int d=0; d<AMREX_SPACEDIM; d++) {
+        resolved[d] = this->Geom(lev).Domain().length(d) > 1;
+        if (resolved[d]) merge_distance = amrex::min(merge_distance, 0.5*dx[d]/parms->nppc[d]);
+    }
+
+    Long nsplit = 0, nmerge = 0;
+
+    for (FNParIter<NF> pti(*this, lev); pti.isValid(); ++pti)
+    {
+        auto& ptile = this->ParticlesAt(lev, pti);
+        auto& aos = ptile.GetArrayOfStructs();
+        const int np = aos.numParticles();
+        if (np == 0) continue;
+
+        // the decisions need every particle in a cell at once, so work on a host copy of the tile
+        Gpu::HostVector<ParticleType> particles(np);
+        Gpu::copy(Gpu::deviceToHost, aos.begin(), aos.end(), particles.begin());
+
+        // group the particles by cell
+        std::map<IntVect, Vector<int> > cells;
+        for (int i=0; i<np; i++) {
+            const IntVect cell(AMREX_D_DECL(static_cast<int>(std::floor((particles[i].pos(0)-plo[0])*dxi[0])),
+                                            static_cast<int>(std::floor((particles[i].pos(1)-plo[1])*dxi[1])),
+                                            static_cast<int>(std::floor((particles[i].pos(2)-plo[2])*dxi[2]))));
+            cells[cell].push_back(i);
+        }
+
+        Vector<ParticleType> new_particles;
+
+        for (const auto& cell : cells) {
+
+            // bundle the particles of the cell by direction
+            Vector<DirectionBundle<NF> > bundles;
+            for (const int i : cell.second) {
+                Real u[3], speed;
+                velocity_direction<NF>(particles[i], u, speed);
+                int ibundle = 0;
+                while (ibundle < bundles.size() &&
+                       u[0]*bundles[ibundle].u[0] + u[1]*bundles[ibundle].u[1] + u[2]*bundles[ibundle].u[2] < cos_bundle_angle)
+                    ibundle++;
+                if (ibundle == bundles.size()) {
+                    bundles.push_back(DirectionBundle<NF>());
+                    for (int d=0; d<3; d++) bundles.back().u[d] = u[d];
+                }
+                bundles[ibundle].members.push_back(i);
+            }
+            const int nbundles = bundles.size();
+            if (nbundles < 2) continue;
+            for (auto& bundle : bundles) bundle_flavor<NF>(bundle, particles);
+
+            // nearest other direction in the cell
+            Vector<int> neighbor(nbundles, -1);
+            Vector<Real> spacing(nbundles, 2.*M_PI);
+            for (int m=0; m<nbundles; m++) {
+                for (int n=0; n<nbundles; n++) {
+                    if (n == m) continue;
+                    const Real* um = bundles[m].u;
+                    const Real* un = bundles[n].u;
+                    const Real cosangle = um[0]*un[0] + um[1]*un[1] + um[2]*un[2];
+                    const Real angle = std::acos(amrex::min(1.0, amrex::max(-1.0, cosangle)));
+                    if (angle < spacing[m]) {
+                        spacing[m] = angle;
+                        neighbor[m] = n;
+                    }
+                }
+            }
+
+            Vector<bool> done(nbundles, false);
+            for (int m=0; m<nbundles; m++) {
+                if (done[m]) continue;
+                const int n = neighbor[m];
+                const Real difference = flavor_difference(bundles[m], bundles[n]);
+
+                //=======//
+                // Split //
+                //=======//
+                // Replace every particle of the bundle by five particles around its direction
+                if (difference > parms->angular_split_threshold && 0.5*spacing[m] >= min_spacing) {
+                    const Real alpha = 0.25*spacing[m];
+                    for (const int i : bundles[m].members) {
+                        ParticleType& p = particles[i];
+                        Real u[3], speed;
+                        velocity_direction<NF>(p, u, speed);
+                        split<NF>(p, u, speed, alpha, new_particles);
+                        p.id() = -1;
+                        nsplit++;
+                    }
+                    done[m] = true;
+                }
+
+                //=======//
+                // Merge //
+                //=======//
+                // Merge each particle of a pair of mutual nearest directions with the
+                // nearest particle of the other direction, if they are close enough
+                else if (neighbor[n] == m && !done[n] &&
+                         difference < parms->angular_merge_threshold && spacing[m] <= max_spacing) {
+                    Vector<bool> paired(bundles[n].members.size(), false);
+                    for (const int i : bundles[m].members) {
+                        ParticleType& p = particles[i];
+                        int nearest = -1;
+                        Real nearest_distance = merge_distance;
+                        for (int k=0; k<bundles[n].members.size(); k++) {
+                            if (paired[k]) continue;
+                            const ParticleType& q = particles[bundles[n].members[k]];
+                            Real distance2 = 0;
+                            for (int d=0; d<AMREX_SPACEDIM; d++)
+                                if (resolved[d]) distance2 += (p.pos(d)-q.pos(d))*(p.pos(d)-q.pos(d));
+                            if (std::sqrt(distance2) <= nearest_distance) {
+                                nearest_distance = std::sqrt(distance2);
+                                nearest = k;
+                            }
+                        }
+                        if (nearest < 0) continue;
+                        paired[nearest] = true;
+                        merge_into<NF>(p, particles[bundles[n].members[nearest]]);
+                        nmerge++;
+                    }
+                    done[m] = true;
+                    done[n] = true;
+                }
+            }
+        }
+
+        // drop the replaced particles and append the new ones
+        Gpu::HostVector<ParticleType> kept;
+        kept.reserve(np + new_particles.size());
+        for (const auto& p : particles) if (p.id() > 0) kept.push_back(p);
+        for (const auto& p : new_particles) kept.push_back(p);
+
+        ptile.resize(kept.size());
+        Gpu::copy(Gpu::hostToDevice, kept.begin(), kept.end(), aos.begin());
+    }
+
+    ParallelDescriptor::ReduceLongSum(nsplit);
+    ParallelDescriptor::ReduceLongSum(nmerge);
+    amrex::Print() << "  Angular refinement: split " << nsplit << " particles, merged " << nmerge << " pairs" << std::endl;
+}
+
+template<int NF>
+void FlavoredNeutrinoContainer<NF>::
+CullLowWeightParticles(const TestParams* parms)
+{
+    BL_PROFILE("FlavoredNeutrinoContainer::CullLowWeightParticles");
+
+    using PIdx = ::PIdx<NF>;
+
+    const int lev = 0;
+    const bool merge = parms->cull_mode == "merge";
+
+    Long nparticles = 0, nculled = 0;
+    Real N_total = 0, Nbar_total = 0, N_dropped = 0, Nbar_dropped = 0;
+
+    for (FNParIter<NF> pti(*this, lev); pti.isValid(); ++pti)
+    {
+        auto& ptile = this->ParticlesAt(lev, pti);
+        auto& aos = ptile.GetArrayOfStructs();
+        const int np = aos.numParticles();
+        if (np == 0) continue;
+        nparticles += np;
+
+        Gpu::HostVector<ParticleType> particles(np);
+        Gpu::copy(Gpu::deviceToHost, aos.begin(), aos.end(), particles.begin());
+
+        // InitParticles gives all directions at a location the same position
+        std::map<std::array<Real,AMREX_SPACEDIM>, Vector<int> > locations;
+        for (int i=0; i<np; i++) {
+            std::array<Real,AMREX_SPACEDIM> location;
+            for (int d=0; d<AMREX_SPACEDIM; d++) location[d] = particles[i].pos(d);
+            locations[location].push_back(i);
+            N_total    += particles[i].rdata(PIdx::N);
+            Nbar_total += particles[i].rdata(PIdx::Nbar);
+        }
+
+        for (const auto& location : locations) {
+            const Vector<int>& members = location.second;
+
+            Real max_weight = 0;
+            for (const int i : members)
+                max_weight = amrex::max(max_weight, particles[i].rdata(PIdx::N) + particles[i].rdata(PIdx::Nbar));
+            const Real min_weight = parms->cull_weight_fraction * max_weight;
+
+            Vector<int> kept, culled;
+            for (const int i : members) {
+                if (particles[i].rdata(PIdx::N) + particles[i].rdata(PIdx::Nbar) < min_weight) culled.push_back(i);
+                else kept.push_back(i);
+            }
+
+            for (const int i : culled) {
+                ParticleType& q = particles[i];
+                if (merge) {
+                    // merge into the kept particle with the nearest direction
+                    Real u[3], speed;
+                    velocity_direction<NF>(q, u, speed);
+                    int nearest = kept[0];
+                    Real max_cosangle = -2;
+                    for (const int j : kept) {
+                        Real v[3], vspeed;
+                        velocity_direction<NF>(particles[j], v, vspeed);
+                        const Real cosangle = u[0]*v[0] + u[1]*v[1] + u[2]*v[2];
+                        if (cosangle > max_cosangle) {
+                            max_cosangle = cosangle;
+                            nearest = j;
+                        }
+                    }
+                    merge_into<NF>(particles[nearest], q);
+                } else {
+                    N_dropped    += q.rdata(PIdx::N);
+                    Nbar_dropped += q.rdata(PIdx::Nbar);
+                    q.id() = -1;
+                }
+                nculled++;
+            }
+        }
+
+        Gpu::HostVector<ParticleType> kept;
+        kept.reserve(np);
+        for (const auto& p : particles) if (p.id() > 0) kept.push_back(p);
+
+        ptile.resize(kept.size());
+        Gpu::copy(Gpu::hostToDevice, kept.begin(), kept.end(), aos.begin());
+    }
+
+    ParallelDescriptor::ReduceLongSum(nparticles);
+    ParallelDescriptor::ReduceLongSum(nculled);
+    ParallelDescriptor::ReduceRealSum(N_total);
+    ParallelDescriptor::ReduceRealSum(Nbar_total);
+    ParallelDescriptor::ReduceRealSum(N_dropped);
+    ParallelDescriptor::ReduceRealSum(Nbar_dropped);
+
+    amrex::Print() << (merge ? "Merged " : "Dropped ") << nculled << " of " << nparticles
+                   << " particles with less than " << parms->cull_weight_fraction
+                   << " of the largest N+Nbar at their location (" << 100.*nculled/amrex::max(nparticles, Long(1))
+                   << "% less work per step)" << std::endl;
+    if (!merge)
+        amrex::Print() << "  dropped fraction of N = " << N_dropped/N_total << ", of Nbar = " << Nbar_dropped/Nbar_total << std::endl;
+}
+
+template void FlavoredNeutrinoContainer<2>::AdaptAngularResolution(const TestParams*);
+template void FlavoredNeutrinoContainer<3>::AdaptAngularResolution(const TestParams*);
+template void FlavoredNeutrinoContainer<2>::CullLowWeightParticles(const TestParams*);
+template void FlavoredNeutrinoContainer<3>::CullLowWeightParticles(const TestParams*);
@@ -0,0 +1,592 @@
+#include "Hybrid.H"
+#include "Constants.H"
+#include "Evolve.H"
+#include "HermitianMatrix.H"
+#include "Stability.H"
+#include <AMReX_VisMF.H>
+#include <AMReX_Utility.H>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <numeric>
+#include <sstream>
+
+using namespace amrex;
+
+namespace
+{
+    // first component of moment m (0 for N, 1+j for F^j) of a tail (0/1 for nu/nubar)
+    template<int NF>
+    AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+    constexpr int moment_comp (const int m, const int tail) { return (2*m + tail)*HermitianMatrix<NF>::ncomp; }
+
+    AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+    Real minmod (const Real a, const Real b)
+    {
+        return a*b <= 0 ? 0 : (std::abs(a) < std::abs(b) ? a : b);
+    }
+
+    // Minerbo closure of the trace, P^ij = D^ij N
+    template<int NF>
+    AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+    void eddington_tensor (const HermitianMatrix<NF> U[4], Real D[3][3])
+    {
+        const Real trN = U[0].trace();
+        const Real trF[3] = {U[1].trace(), U[2].trace(), U[3].trace()};
+        const Real Fmag2 = trF[0]*trF[0] + trF[1]*trF[1] + trF[2]*trF[2];
+        const Real fluxfac = trN > 0 ? amrex::min(std::sqrt(Fmag2)/trN, 1.0) : 0;
+        const Real chi = 1./3. + 2./15.*fluxfac*fluxfac*(3. - fluxfac + 3.*fluxfac*fluxfac);
+        for (int a=0; a<3; a++) {
+            for (int b=0; b<3; b++) {
+                D[a][b] = a==b ? 0.5*(1.-chi) : 0;
+                if (Fmag2 > 0) D[a][b] += 0.5*(3.*chi-1.)*trF[a]*trF[b]/Fmag2;
+            }
+        }
+    }
+
+    // Rusanov flux (divided by c) of the moments of a tail through the face
+    // between cells (i,j,k) - e_dim and (i,j,k), from minmod-limited face values
+    template<int NF>
+    AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+    void face_flux (Array4<const Real> const& marr, const int i, const int j, const int k,
+                    const int dim, const int tail, HermitianMatrix<NF> flux[4])
+    {
+        using FlavorMatrix = HermitianMatrix<NF>;
+        constexpr int ncomp = FlavorMatrix::ncomp;
+        const IntVect shift = IntVect::TheDimensionVector(dim);
+        FlavorMatrix UL[4], UR[4];
+        for (int m=0; m<4; m++) {
+            for (int icomp=0; icomp<ncomp; icomp++) {
+                const int comp = moment_comp<NF>(m, tail) + icomp;
+                auto q = [&] (int s) -> Real {
+                    return marr(i + s*shift[0], j + s*shift[1], k + s*shift[2], comp);
+                };
+                UL[m].c[icomp] = q(-1) + 0.5*minmod(q(-1) - q(-2), q( 0) - q(-1));
+                UR[m].c[icomp] = q( 0) - 0.5*minmod(q( 0) - q(-1), q( 1) - q( 0));
+            }
+        }
+
+        Real DL[3][3], DR[3][3];
+        eddington_tensor(UL, DL);
+        eddington_tensor(UR, DR);
+
+        for (int icomp=0; icomp<ncomp; icomp++) {
+            flux[0].c[icomp] = 0.5*(UL[1+dim].c[icomp] + UR[1+dim].c[icomp]) - 0.5*(UR[0].c[icomp] - UL[0].c[icomp]);
+            for (int a=0; a<3; a++)
+                flux[1+a].c[icomp] = 0.5*(DL[a][dim]*UL[0].c[icomp] + DR[a][dim]*UR[0].c[icomp])
+                                   - 0.5*(UR[1+a].c[icomp] - UL[1+a].c[icomp]);
+        }
+    }
+}
+
+template<int NF>
+HybridMoments<NF>::HybridMoments(const Geometry& a_geom, const BoxArray& ba, const DistributionMapping& dm,
+                                 const FlavoredNeutrinoContainer<NF>& neutrinos, const TestParams* a_parms, const Real a_time)
+    : geom(a_geom), parms(a_parms), time(a_time), box_mode(ba.size(), 1)
+{
+    static_assert(GIdx<NF>::ncomp == GIdx<NF>::N00_Re + nmoments, "the mesh stores N, Nbar, Fx, Fxbar, Fy, Fybar, Fz, Fzbar");
+
+    directions = make_direction_set(parms);
+
+    // the promoted particles carry F exactly through M^-1, M = sum_d w_d u_d u_d
+    Real M[3][3] = {};
+    for (int d=0; d<directions.size(); d++)
+        for (int a=0; a<3; a++)
+            for (int b=0; b<3; b++)
+                M[a][b] += directions.weight[d]*directions.xyz[d][a]*directions.xyz[d][b];
+    const Real det = M[0][0]*(M[1][1]*M[2][2] - M[1][2]*M[2][1])
+                   - M[0][1]*(M[1][0]*M[2][2] - M[1][2]*M[2][0])
+                   + M[0][2]*(M[1][0]*M[2][1] - M[1][1]*M[2][0]);
+    if (det < 1e-6)
+        amrex::Error("hybrid_every > 0 requires a direction set that spans all three dimensions");
+    for (int a=0; a<3; a++) {
+        for (int b=0; b<3; b++) {
+            const int a1 = (b+1)%3, a2 = (b+2)%3, b1 = (a+1)%3, b2 = (a+2)%3;
+            inverse_second_moment[3*a+b] = (M[a1][b1]*M[a2][b2] - M[a1][b2]*M[a2][b1]) / det;
+        }
+    }
+
+    // the moments and promoted particles are evolved with a single energy
+    if (neutrinos.TotalNumberOfParticles() > 0) {
+        Real pupt_min = amrex::ReduceMin(neutrinos, [=] AMREX_GPU_DEVICE (const typename FlavoredNeutrinoContainer<NF>::ParticleType& p) -> Real { return p.rdata(PIdx<NF>::pupt); });
+        Real pupt_max = amrex::ReduceMax(neutrinos, [=] AMREX_GPU_DEVICE (const typename FlavoredNeutrinoContainer<NF>::ParticleType& p) -> Real { return p.rdata(PIdx<NF>::pupt); });
+        ParallelDescriptor::ReduceRealMin(pupt_min);
+        ParallelDescriptor::ReduceRealMax(pupt_max);
+        if (pupt_max - pupt_min > 1e-12*pupt_max)
+            amrex::Error("hybrid_every > 0 requires all particles to have the same energy");
+        energy = pupt_max;
+    }
+
+    // the reconstruction reaches two cells past the cell in the directions that are resolved
+    IntVect ngrow(0);
+    for (int dim=0; dim<AMREX_SPACEDIM; dim++) {
+        if (geom.Domain().length(dim) > 1) {
+            ngrow[dim] = 2;
+            AMREX_ALWAYS_ASSERT(geom.Domain().length(dim) >= ngrow[dim]);
+        }
+    }
+
+    moments      .define(ba, dm, nmoments, ngrow);
+    moments_stage.define(ba, dm, nmoments, ngrow);
+    rhs          .define(ba, dm, nmoments, 0);
+    particle_state.define(ba, dm, GIdx<NF>::ncomp, 0);
+    stage_state   .define(ba, dm, GIdx<NF>::ncomp, 0);
+    moments.setVal(0.0);
+}
+
+template<int NF>
+void HybridMoments<NF>::CheckEnergy() const
+{
+    if (energy <= 0)
+        amrex::Error("hybrid_every > 0: no particle energy to evolve the moments with");
+}
+
+template<int NF>
+void HybridMoments<NF>::Switch(const MultiFab& state, FlavoredNeutrinoContainer<NF>& neutrinos)
+{
+    BL_PROFILE("HybridMoments::Switch");
+
+    CheckEnergy();
+
+    iMultiFab crossing(state.boxArray(), state.DistributionMap(), 1, 0);
+    flag_eln_crossings<NF>(state, crossing);
+
+    // the boxes with crossings evolve particles
+    Vector<int> new_mode(box_mode.size(), 0);
+    for (MFIter mfi(crossing); mfi.isValid(); ++mfi)
+        new_mode[mfi.index()] = crossing[mfi].sum<RunOn::Device>(mfi.validbox(), 0) > 0;
+    ParallelDescriptor::ReduceIntSum(new_mode.data(), static_cast<int>(new_mode.size()));
+
+    int nparticle_boxes = 0, npromoted_boxes = 0, ndemoted_boxes = 0;
+    for (int ibox=0; ibox<static_cast<int>(box_mode.size()); ibox++) {
+        nparticle_boxes += new_mode[ibox];
+        npromoted_boxes += new_mode[ibox] && !box_mode[ibox];
+        ndemoted_boxes  += !new_mode[ibox] && box_mode[ibox];
+    }
+    box_mode = new_mode;
+
+    Long ndemoted = Demote(neutrinos);
+    Long napproximate = 0;
+    Long npromoted = Promote(neutrinos, napproximate);
+    ParallelDescriptor::ReduceLongSum(ndemoted);
+    ParallelDescriptor::ReduceLongSum(npromoted);
+    ParallelDescriptor::ReduceLongSum(napproximate);
+
+    amrex::Print() << "  Hybrid: " << nparticle_boxes << " of " << box_mode.size() << " boxes evolve particles ("
+                   << npromoted_boxes << " promoted, " << ndemoted_boxes << " demoted); "
+                   << ndemoted << " particles became moments, the moments of " << npromoted << " cells became "
+                   << npromoted*directions.size() << " particles (" << napproximate << " cells conserving only N)" << std::endl;
+}
+
+template<int NF>
+Long HybridMoments<NF>::Demote(FlavoredNeutrinoContainer<NF>& neutrinos)
+{
+    BL_PROFILE("HybridMoments::Demote");
+
+    using PIdx = ::PIdx<NF>;
+
+    const int lev = 0;
+    const auto plo = geom.ProbLoArray();
+    const auto dxi = geom.InvCellSizeArray();
+
+    Long ndemoted = 0;
+    for (FNParIter<NF> pti(neutrinos, lev); pti.isValid(); ++pti)
+    {
+        if (box_mode[pti.index()]) continue;
+        const int np = pti.numParticles();
+        if (np == 0) continue;
+
+        auto& ptile = neutrinos.ParticlesAt(lev, pti);
+        const auto* pstruct = ptile.GetArrayOfStructs()().data();
+        auto const& marr = moments.array(pti);
+
+        // N f and N f v of each particle go to its cell
+        amrex::ParallelFor(np, [=] AMREX_GPU_DEVICE (int ip)
+        {
+            const auto& p = pstruct[ip];
+            const int i = static_cast<int>(amrex::Math::floor((p.pos(0) - plo[0]) * dxi[0]));
+            const int j = static_cast<int>(amrex::Math::floor((p.pos(1) - plo[1]) * dxi[1]));
+            const int k = static_cast<int>(amrex::Math::floor((p.pos(2) - plo[2]) * dxi[2]));
+            const Real inv_pupt = 1.0/p.rdata(PIdx::pupt);
+            const Real v[3] = {p.rdata(PIdx::pupx)*inv_pupt, p.rdata(PIdx::pupy)*inv_pupt, p.rdata(PIdx::pupz)*inv_pupt};
+
+            for (int tail=0; tail<2; tail++) {
+                const Real N = p.rdata(tail ? PIdx::Nbar : PIdx::N);
+                const int f0 = tail ? PIdx::f00_Rebar : PIdx::f00_Re;
+                for (int icomp=0; icomp<ncomp; icomp++) {
+                    const Real n = N * p.rdata(f0 + icomp);
+                    amrex::Gpu::Atomic::AddNoRet(&marr(i,j,k, moment_comp<NF>(0,tail) + icomp), n);
+                    for (int a=0; a<3; a++)
+                        amrex::Gpu::Atomic::AddNoRet(&marr(i,j,k, moment_comp<NF>(1+a,tail) + icomp), n*v[a]);
+                }
+            }
+        });
+        Gpu::streamSynchronize();
+
+        ptile.resize(0);
+        ndemoted += np;
+    }
+    return ndemoted;
+}
+
+template<int NF>
+Long HybridMoments<NF>::Promote(FlavoredNeutrinoContainer<NF>& neutrinos, Long& napproximate)
+{
+    BL_PROFILE("HybridMoments::Promote");
+
+    using PIdx = ::PIdx<NF>;
+    using ParticleType = typename FlavoredNeutrinoContainer<NF>::ParticleType;
+
+    const int lev = 0;
+    const auto plo = geom.ProbLoArray();
+    const auto dx = geom.CellSizeArray();
+    const auto* xyz = directions.xyz.dataPtr();
+    const auto* weight = directions.weight.dataPtr();
+    const int ndirections = directions.size();
+    const auto Minv = inverse_second_moment;
+    const Real pupt = energy;
+    const Real particle_time = time;
+    const int procID = ParallelDescriptor::MyProc();
+
+    Long npromoted = 0;
+    for (MFIter mfi = neutrinos.MakeMFIter(lev); mfi.isValid(); ++mfi)
+    {
+        if (!box_mode[mfi.index()]) continue;
+
+        const Box& tile_box = mfi.tilebox();
+        const auto lo = amrex::lbound(tile_box);
+        const auto len = amrex::length(tile_box);
+        auto const& marr = moments.array(mfi);
+
+        Gpu::ManagedVector<unsigned int> counts(tile_box.numPts(), 0);
+        Gpu::ManagedVector<unsigned int> offsets(tile_box.numPts());
+        Gpu::ManagedVector<unsigned int> approximate(tile_box.numPts(), 0);
+        unsigned int* pcount = counts.dataPtr();
+        unsigned int* poffset = offsets.dataPtr();
+        unsigned int* papproximate = approximate.dataPtr();
+
+        // the cells with moments that have no negative diagonal become one particle per direction
+        amrex::ParallelFor(tile_box,
+        [=] AMREX_GPU_DEVICE (int i, int j, int k) noexcept
+        {
+            const int cellid = ((k-lo.z)*len.y + (j-lo.y))*len.x + (i-lo.x);
+            bool nonzero = false, realizable = true;
+            for (int tail=0; tail<2; tail++) {
+                for (int a=0; a<NF; a++) {
+                    const Real Naa = marr(i,j,k, moment_comp<NF>(0,tail) + FlavorMatrix::Re(a,a));
+                    nonzero = nonzero || Naa > 0;
+                    realizable = realizable && Naa >= 0;
+                }
+            }
+            pcount[cellid] = nonzero && realizable ? ndirections : 0;
+        });
+
+        Gpu::inclusive_scan(counts.begin(), counts.end(), offsets.begin());
+        Gpu::streamSynchronize();
+
+        const int num_to_add = offsets[tile_box.numPts()-1];
+        if (num_to_add == 0) continue;
+
+        auto& particle_tile = neutrinos.GetParticles(lev)[std::make_pair(mfi.index(), mfi.LocalTileIndex())];
+        const auto old_size = particle_tile.GetArrayOfStructs().size();
+        particle_tile.resize(old_size + num_to_add);
+        const Long new_pid = ParticleType::NextID();
+        ParticleType::NextID(new_pid + num_to_add);
+        ParticleType* pstruct = particle_tile.GetArrayOfStructs()().data() + old_size;
+
+        amrex::ParallelFor(tile_box,
+        [=] AMREX_GPU_DEVICE (int i, int j, int k) noexcept
+        {
+            const int cellid = ((k-lo.z)*len.y + (j-lo.y))*len.x + (i-lo.x);
+            if (pcount[cellid] == 0) return;
+            const int first = poffset[cellid] - pcount[cellid];
+
+            for (int d=0; d<ndirections; d++) {
+                ParticleType& p = pstruct[first + d];
+                p.id()  = new_pid + first + d;
+                p.cpu() = procID;
+                p.pos(0) = plo[0] + (i + 0.5)*dx[0];
+                p.pos(1) = plo[1] + (j + 0.5)*dx[1];
+                p.pos(2) = plo[2] + (k + 0.5)*dx[2];
+                p.rdata(PIdx::x) = p.pos(0);
+                p.rdata(PIdx::y) = p.pos(1);
+                p.rdata(PIdx::z) = p.pos(2);
+                p.rdata(PIdx::time) = particle_time;
+                p.rdata(PIdx::pupx) = xyz[d][0]*pupt;
+                p.rdata(PIdx::pupy) = xyz[d][1]*pupt;
+                p.rdata(PIdx::pupz) = xyz[d][2]*pupt;
+                p.rdata(PIdx::pupt) = pupt;
+            }
+
+            for (int tail=0; tail<2; tail++) {
+                FlavorMatrix U[4];
+                for (int m=0; m<4; m++) U[m].load(&marr(i,j,k, moment_comp<NF>(m,tail)), static_cast<int>(marr.nstride));
+
+                // Minerbo distribution along the flux of the trace, normalized over the set
+                const Real trN = U[0].trace();
+                const Real trF[3] = {U[1].trace(), U[2].trace(), U[3].trace()};
+                const Real Fmag = std::sqrt(trF[0]*trF[0] + trF[1]*trF[1] + trF[2]*trF[2]);
+                const Real Z = trN > 0 ? minerbo_Z(Fmag/trN) : 0;
+                const Real Fhat[3] = {Fmag > 0 ? trF[0]/Fmag : 0, Fmag > 0 ? trF[1]/Fmag : 0, Fmag > 0 ? trF[2]/Fmag : 1};
+                auto shape = [&] (int d) -> Real {
+                    return weight[d] * minerbo_distribution(1.0, Z, xyz[d][0]*Fhat[0] + xyz[d][1]*Fhat[1] + xyz[d][2]*Fhat[2]);
+                };
+                Real norm = 0, Phi[3] = {0, 0, 0};
+                for (int d=0; d<ndirections; d++) {
+                    const Real g = shape(d);
+                    norm += g;
+                    for (int a=0; a<3; a++) Phi[a] += g*xyz[d][a];
+                }
+                for (int a=0; a<3; a++) Phi[a] /= norm;
+
+                // R = M^-1 (F - Phi N), so that n_d = g_d N + w_d u_d . R
+                FlavorMatrix R[3];
+                for (int a=0; a<3; a++) {
+                    for (int b=0; b<3; b++) {
+                        for (int icomp=0; icomp<ncomp; icomp++)
+                            R[a].c[icomp] += Minv[3*a+b] * (U[1+b].c[icomp] - Phi[b]*U[0].c[icomp]);
+                    }
+                }
+                auto direction_moment = [&] (int d, bool exact) -> FlavorMatrix {
+                    FlavorMatrix n = U[0];
+                    n *= shape(d)/norm;
+                    if (exact) {
+                        for (int a=0; a<3; a++) {
+                            FlavorMatrix correction = R[a];
+                            correction *= weight[d]*xyz[d][a];
+                            n += correction;
+                        }
+                    }
+                    return n;
+                };
+
+                bool exact = true;
+                for (int d=0; d<ndirections && exact; d++) {
+                    const FlavorMatrix n = direction_moment(d, true);
+                    for (int a=0; a<NF; a++) exact = exact && n.c[FlavorMatrix::Re(a,a)] >= 0;
+                }
+                if (!exact) papproximate[cellid] = 1;
+
+                const int iN  = tail ? PIdx::Nbar : PIdx::N;
+                const int iL  = tail ? PIdx::Lbar : PIdx::L;
+                const int if0 = tail ? PIdx::f00_Rebar : PIdx::f00_Re;
+                const int ibg = tail ? PIdx::f00_Rebar_bg : PIdx::f00_Re_bg;
+                for (int d=0; d<ndirections; d++) {
+                    ParticleType& p = pstruct[first + d];
+                    FlavorMatrix f = direction_moment(d, exact);
+                    const Real N = f.trace();
+                    if (N > 0) {
+                        f *= 1.0/N;
+                    } else {
+                        // an empty tail keeps a pure state
+                        f = FlavorMatrix();
+                        f.c[FlavorMatrix::Re(0,0)] = 1;
+                    }
+                    p.rdata(iN) = amrex::max(N, 0.0);
+                    f.store(&p.rdata(if0));
+                    for (int a=0; a<NF; a++) p.rdata(ibg + a) = f.c[FlavorMatrix::Re(a,a)];
+                    p.rdata(iL) = std::sqrt(f.SU_vector_magnitude2());
+                }
+            }
+
+            for (int comp=0; comp<nmoments; comp++) marr(i,j,k,comp) = 0;
+        });
+        Gpu::streamSynchronize();
+
+        for (Long n=0; n<tile_box.numPts(); n++) {
+            npromoted += counts[n] > 0;
+            napproximate += approximate[n];
+        }
+    }
+    return npromoted;
+}
+
+template<int NF>
+void HybridMoments<NF>::AddMoments(MultiFab& state) const
+{
+    MultiFab::Add(state, moments, 0, GIdx<NF>::N00_Re, nmoments, 0);
+    state.FillBoundary(geom.periodicity());
+}
+
+template<int NF>
+void HybridMoments<NF>::ComputeRHS(const MultiFab& stage, MultiFab& a_rhs, const MultiFab& total) const
+{
+    BL_PROFILE("HybridMoments::ComputeRHS");
+
+    const auto dxi = geom.InvCellSizeArray();
+    const Real inv_cell_volume = dxi[0]*dxi[1]*dxi[2];
+    const Real sqrt2GF_inv_cell_volume = M_SQRT2*PhysConst::GF*inv_cell_volume;
+    const Real cell_volume_over_Mp = 1.0/(inv_cell_volume*PhysConst::Mp);
+    const Real inv_hbar = 1.0/PhysConst::hbar;
+
+    const IntVect resolved(AMREX_D_DECL(geom.Domain().length(0) > 1,
+                                        geom.Domain().length(1) > 1,
+                                        geom.Domain().length(2) > 1));
+    const Real pupt = energy;
+    const FlavorMatrix M2 = flavor_mass_matrix<NF>(parms);
+
+#ifdef _OPENMP
+#pragma omp parallel if (Gpu::notInLaunchRegion())
+#endif
+    for (MFIter mfi(a_rhs, TilingIfNotGPU()); mfi.isValid(); ++mfi)
+    {
+        const Box& bx = mfi.tilebox();
+        auto const& marr = stage.const_array(mfi);
+        auto const& sarr = total.const_array(mfi);
+        auto const& rarr = a_rhs.array(mfi);
+
+        amrex::ParallelFor(bx,
+        [=] AMREX_GPU_DEVICE (int i, int j, int k)
+        {
+            // the potentials seen with velocity 0 and with velocity e_a, minus the former
+            Real V0[2*ncomp], dV[3][2*ncomp];
+            cell_center_potential<NF>(OrdinateMomentum{{0, 0, 0, pupt}}, sarr, i, j, k,
+                                      sqrt2GF_inv_cell_volume, cell_volume_over_Mp, M2, V0);
+            for (int a=0; a<3; a++) {
+                OrdinateMomentum p{{0, 0, 0, pupt}};
+                p.pup[a] = pupt;
+                cell_center_potential<NF>(p, sarr, i, j, k, sqrt2GF_inv_cell_volume, cell_volume_over_Mp, M2, dV[a]);
+                for (int n=0; n<2*ncomp; n++) dV[a][n] -= V0[n];
+            }
+
+            for (int tail=0; tail<2; tail++) {
+                FlavorMatrix U[4];
+                for (int m=0; m<4; m++) U[m].load(&marr(i,j,k, moment_comp<NF>(m,tail)), static_cast<int>(marr.nstride));
+
+                FlavorMatrix A, B[3];
+                A.load(&V0[tail*ncomp]);
+                for (int a=0; a<3; a++) B[a].load(&dV[a][tail*ncomp]);
+
+                Real D[3][3];
+                eddington_tensor(U, D);
+
+                // -i[V0, N] - i sum_j [B_j, F^j] and -i[V0, F^a] - i [sum_j D^aj B_j, N]
+                FlavorMatrix dUdt[4];
+                dUdt[0] = FlavorMatrix::minus_i_commutator(A, U[0]);
+                for (int b=0; b<3; b++) dUdt[0] += FlavorMatrix::minus_i_commutator(B[b], U[1+b]);
+                for (int a=0; a<3; a++) {
+                    dUdt[1+a] = FlavorMatrix::minus_i_commutator(A, U[1+a]);
+                    FlavorMatrix BD;
+                    for (int b=0; b<3; b++) {
+                        FlavorMatrix term = B[b];
+                        term *= D[a][b];
+                        BD += term;
+                    }
+                    dUdt[1+a] += FlavorMatrix::minus_i_commutator(BD, U[0]);
+                }
+                for (int m=0; m<4; m++) dUdt[m] *= inv_hbar;
+
+                for (int dim=0; dim<AMREX_SPACEDIM; dim++) {
+                    if (!resolved[dim]) continue;
+                    const IntVect shift = IntVect::TheDimensionVector(dim);
+                    FlavorMatrix flux_lo[4], flux_hi[4];
+                    face_flux<NF>(marr, i, j, k, dim, tail, flux_lo);
+                    face_flux<NF>(marr, i+shift[0], j+shift[1], k+shift[2], dim, tail, flux_hi);
+                    const Real rate = PhysConst::c * dxi[dim];
+                    for (int m=0; m<4; m++)
+                        for (int icomp=0; icomp<ncomp; icomp++)
+                            dUdt[m].c[icomp] -= rate * (flux_hi[m].c[icomp] - flux_lo[m].c[icomp]);
+                }
+
+                for (int m=0; m<4; m++) dUdt[m].store(&rarr(i,j,k, moment_comp<NF>(m,tail)), static_cast<int>(rarr.nstride));
+            }
+        });
+    }
+}
+
+template<int NF>
+void HybridMoments<NF>::StageRHS(MultiFab& stage)
+{
+    stage.FillBoundary(geom.periodicity());
+    MultiFab::Copy(stage_state, particle_state, 0, 0, GIdx<NF>::ncomp, 0);
+    MultiFab::Add(stage_state, stage, 0, GIdx<NF>::N00_Re, nmoments, 0);
+    ComputeRHS(stage, rhs, stage_state);
+}
+
+template<int NF>
+void HybridMoments<NF>::AdvanceTo(MultiFab& state, const Real new_time)
+{
+    BL_PROFILE("HybridMoments::AdvanceTo");
+
+    CheckEnergy();
+
+    if (new_time <= time) return;
+
+    // the particle deposit alone
+    MultiFab::Copy(particle_state, state, 0, 0, GIdx<NF>::ncomp, 0);
+    MultiFab::Subtract(particle_state, moments, 0, GIdx<NF>::N00_Re, nmoments, 0);
+
+    // substeps with a Courant number, summed over the resolved directions, of at most 1/2
+    const auto dxi = geom.InvCellSizeArray();
+    Real courant = 0;
+    for (int dim=0; dim<AMREX_SPACEDIM; dim++)
+        if (geom.Domain().length(dim) > 1) courant += PhysConst::c * (new_time - time) * dxi[dim];
+    const int nsubsteps = amrex::max(1, static_cast<int>(std::ceil(2*courant)));
+    const Real dt = (new_time - time) / nsubsteps;
+
+    // Shu & Osher, J. Comput. Phys. 77, 439 (1988)
+    for (int substep=0; substep<nsubsteps; substep++) {
+        // m1 = m + dt L(m)
+        StageRHS(moments);
+        MultiFab::LinComb(moments_stage, 1.0, moments, 0, dt, rhs, 0, 0, nmoments, 0);
+
+        // m2 = 3/4 m + 1/4 (m1 + dt L(m1))
+        StageRHS(moments_stage);
+        MultiFab::Saxpy(moments_stage, dt, rhs, 0, 0, nmoments, 0);
+        MultiFab::LinComb(moments_stage, 0.75, moments, 0, 0.25, moments_stage, 0, 0, nmoments, 0);
+
+        // m_new = 1/3 m + 2/3 (m2 + dt L(m2))
+        StageRHS(moments_stage);
+        MultiFab::Saxpy(moments_stage, dt, rhs, 0, 0, nmoments, 0);
+        MultiFab::LinComb(moments, 1./3., moments, 0, 2./3., moments_stage, 0, 0, nmoments, 0);
+    }
+    time = new_time;
+
+    // the particle deposit plus the new moments
+    MultiFab::Copy(state, particle_state, 0, 0, GIdx<NF>::ncomp, 0);
+    AddMoments(state);
+}
+
+template<int NF>
+void HybridMoments<NF>::WriteCheckpoint(const std::string& dir) const
+{
+    BL_PROFILE("HybridMoments::WriteCheckpoint");
+
+    VisMF::Write(moments, dir + "/hybrid_moments");
+
+    if (ParallelDescriptor::IOProcessor()) {
+        std::ofstream header(dir + "/hybrid_header");
+        header << std::setprecision(17) << energy << "\n" << box_mode.size() << "\n";
+        for (const int mode : box_mode) header << mode << "\n";
+    }
+}
+
+template<int NF>
+bool HybridMoments<NF>::ReadCheckpoint(const std::string& dir)
+{
+    BL_PROFILE("HybridMoments::ReadCheckpoint");
+
+    if (!amrex::FileExists(dir + "/hybrid_header")) return false;
+
+    Vector<char> buffer;
+    ParallelDescriptor::ReadAndBcastFile(dir + "/hybrid_header", buffer);
+    std::istringstream header(buffer.dataPtr());
+
+    std::size_t nboxes = 0;
+    header >> energy >> nboxes;
+    if (nboxes != box_mode.size())
+        amrex::Error("hybrid: the restart plotfile has a different number of boxes");
+    for (int& mode : box_mode) header >> mode;
+
+    MultiFab saved;
+    VisMF::Read(saved, dir + "/hybrid_moments");
+    moments.setVal(0.0);
+    moments.ParallelCopy(saved, 0, 0, nmoments);
+
+    amrex::Print() << "Restarting the hybrid mode with " << std::accumulate(box_mode.begin(), box_mode.end(), 0)
+                   << " of " << box_mode.size() << " boxes evolving particles" << std::endl;
+    return true;
+}
+
+template class HybridMoments<2>;
+template class HybridMoments<3>;
@@ -8,24 +8,33 @@
 
 using namespace amrex;
 
+template<int NF>
 void
 WritePlotFile (const amrex::MultiFab& state,
-               const FlavoredNeutrinoContainer& neutrinos,
+               const FlavoredNeutrinoContainer<NF>& neutrinos,
                const amrex::Geometry& geom, amrex::Real time,
                int step, int write_plot_particles)
 {
-    BL_PROFILE("WritePlotFile()");
-
-    BoxArray grids = state.boxArray();
-    grids.convert(IntVect());
+    WritePlotFile({&state}, neutrinos, {geom}, {}, time, step, write_plot_particles);
+}
 
-    const DistributionMapping& dmap = state.DistributionMap();
+template<int NF>
+void
+WritePlotFile (const amrex::Vector<const amrex::MultiFab*>& state,
+               const FlavoredNeutrinoContainer<NF>& neutrinos,
+               const amrex::Vector<amrex::Geometry>& geom,
+               const amrex::Vector<amrex::IntVect>& ref_ratio,
+               amrex::Real time, int step, int write_plot_particles)
+{
+    BL_PROFILE("WritePlotFile()");
 
     const std::string& plotfilename = amrex::Concatenate("plt", step);
 
     amrex::Print() << "  Writing plotfile " << plotfilename << "\n";
 
-    amrex::WriteSingleLevelPlotfile(plotfilename, state, GIdx::names, geom, time, step);
+    const int nlevels = state.size();
+    const Vector<int> level_steps(nlevels, step);
+    amrex::WriteMultiLevelPlotfile(plotfilename, nlevels, state, GIdx<NF>::names, geom, time, level_steps, ref_ratio);
 
     if (write_plot_particles == 1)
     {
@@ -34,12 +43,13 @@ WritePlotFile (const amrex::MultiFab& state,
     }
 
     // write job information
-    writeJobInfo (plotfilename, geom);
+    writeJobInfo (plotfilename, geom[0]);
 }
 
+template<int NF>
 void
 RecoverParticles (const std::string& dir,
-				  FlavoredNeutrinoContainer& neutrinos,
+				  FlavoredNeutrinoContainer<NF>& neutrinos,
 				  amrex::Real& time, int& step)
 {
     BL_PROFILE("RecoverParticles()");
@@ -54,6 +64,12 @@ RecoverParticles (const std::string& dir,
 	const int lev = 0;
 	step = plotfile.levelStep(lev);
 
+	// the plotfile must come from a run with the same number of flavors
+	if (plotfile.nComp() != GIdx<NF>::ncomp)
+		amrex::Error("RecoverParticles: the plotfile has " + std::to_string(plotfile.nComp()) +
+		             " mesh components but num_flavors = " + std::to_string(NF) + " needs " +
+		             std::to_string(GIdx<NF>::ncomp) + ". Restart with the num_flavors of the original run.");
+
 	// initialize our particle container from the plotfile
 	std::string file("neutrinos");
 	neutrinos.Restart(dir, file);
@@ -62,6 +78,15 @@ RecoverParticles (const std::string& dir,
 	amrex::Print() << "Restarting after time step: " << step-1 << " t = " << time << " s.  ct = " << PhysConst::c * time << " cm" << std::endl;
 }
 
+template void WritePlotFile(const MultiFab&, const FlavoredNeutrinoContainer<2>&, const Geometry&, Real, int, int);
+template void WritePlotFile(const MultiFab&, const FlavoredNeutrinoContainer<3>&, const Geometry&, Real, int, int);
+template void WritePlotFile(const Vector<const MultiFab*>&, const FlavoredNeutrinoContainer<2>&, const Vector<Geometry>&,
+                            const Vector<IntVect>&, Real, int, int);
+template void WritePlotFile(const Vector<const MultiFab*>&, const FlavoredNeutrinoContainer<3>&, const Vector<Geometry>&,
+                            const Vector<IntVect>&, Real, int, int);
+template void RecoverParticles(const std::string&, FlavoredNeutrinoContainer<2>&, Real&, int&);
+template void RecoverParticles(const std::string&, FlavoredNeutrinoContainer<3>&, Real&, int&);
+
 
 // writeBuildInfo and writeJobInfo are copied from Castro/Source/driver/Castro_io.cpp
 // and modified by Sherwood Richers
@@ -0,0 +1,165 @@
+#include "NoSelfInteraction.H"
+#include "Evolve.H"
+#include "Constants.H"
+#include "HermitianMatrix.H"
+#include "ParticleInterpolator.H"
+#include "IO.H"
+#include <iomanip>
+
+using namespace amrex;
+
+template<int NF>
+void advance_without_self_interaction(FlavoredNeutrinoContainer<NF>& neutrinos, const MultiFab& state,
+                                      const Geometry& geom, const TestParams* parms, const Real dt)
+{
+    BL_PROFILE("advance_without_self_interaction");
+
+    const auto plo = geom.ProbLoArray();
+    const auto dxi = geom.InvCellSizeArray();
+    const Real inv_cell_volume = dxi[0]*dxi[1]*dxi[2];
+    const Real sqrt2GF_inv_cell_volume = M_SQRT2*PhysConst::GF*inv_cell_volume;
+    const Real cell_volume_over_Mp = 1.0/(inv_cell_volume*PhysConst::Mp);
+
+    const int shape_factor_order_x = geom.Domain().length(0) > 1 ? SHAPE_FACTOR_ORDER : 0;
+    const int shape_factor_order_y = geom.Domain().length(1) > 1 ? SHAPE_FACTOR_ORDER : 0;
+    const int shape_factor_order_z = geom.Domain().length(2) > 1 ? SHAPE_FACTOR_ORDER : 0;
+
+    using PIdx = ::PIdx<NF>;
+    using FlavorMatrix = HermitianMatrix<NF>;
+    using ParticleType = typename FlavoredNeutrinoContainer<NF>::ParticleType;
+    constexpr int ncomp_V = 2*FlavorMatrix::ncomp;
+    const FlavorMatrix M2 = flavor_mass_matrix<NF>(parms);
+    const Real dt_over_hbar = dt/PhysConst::hbar;
+
+    const int lev = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    for (FNParIter<NF> pti(neutrinos, lev); pti.isValid(); ++pti)
+    {
+        const int np = pti.numParticles();
+        ParticleType* pstruct = &(pti.GetArrayOfStructs()[0]);
+        auto const& sarr = state.const_array(pti);
+
+        amrex::ParallelFor(np, [=] AMREX_GPU_DEVICE (int ip)
+        {
+            ParticleType& p = pstruct[ip];
+
+            // the N and F on the mesh are zero, so this is the vacuum plus matter potential
+            FlavorPotential<NF> potential(p);
+
+            const amrex::Real delta_x = (p.pos(0) - plo[0]) * dxi[0];
+            const amrex::Real delta_y = (p.pos(1) - plo[1]) * dxi[1];
+            const amrex::Real delta_z = (p.pos(2) - plo[2]) * dxi[2];
+
+            const ParticleInterpolator<SHAPE_FACTOR_ORDER> sx(delta_x, shape_factor_order_x);
+            const ParticleInterpolator<SHAPE_FACTOR_ORDER> sy(delta_y, shape_factor_order_y);
+            const ParticleInterpolator<SHAPE_FACTOR_ORDER> sz(delta_z, shape_factor_order_z);
+
+            for (int k = sz.first(); k <= sz.last(); ++k) {
+                for (int j = sy.first(); j <= sy.last(); ++j) {
+                    const amrex::Real weight_jk = sy(j) * sz(k);
+                    for (int i = sx.first(); i <= sx.last(); ++i) {
+                        potential.AddCell(sarr, i, j, k, sx(i) * weight_jk, cell_volume_over_Mp);
+                    }
+                }
+            }
+
+            amrex::Real V[ncomp_V];
+            potential.Store(M2, sqrt2GF_inv_cell_volume, V);
+
+            const int f_start[2] = {PIdx::f00_Re, PIdx::f00_Rebar};
+            for (int tail = 0; tail < 2; ++tail) {
+                FlavorMatrix H, f;
+                H.load(&V[tail*FlavorMatrix::ncomp]);
+                f.load(&p.rdata(f_start[tail]));
+                FlavorMatrix::unitary_evolution(H, f, dt_over_hbar).store(&p.rdata(f_start[tail]));
+            }
+
+            // straight-line motion at the speed of light
+            const amrex::Real c_over_pupt = PhysConst::c / p.rdata(PIdx::pupt);
+            p.rdata(PIdx::x) += p.rdata(PIdx::pupx) * c_over_pupt * dt;
+            p.rdata(PIdx::y) += p.rdata(PIdx::pupy) * c_over_pupt * dt;
+            p.rdata(PIdx::z) += p.rdata(PIdx::pupz) * c_over_pupt * dt;
+            p.rdata(PIdx::time) += dt;
+        });
+    }
+}
+
+template<int NF>
+void evolve_without_self_interaction(FlavoredNeutrinoContainer<NF>& neutrinos, MultiFab& state,
+                                     const Geometry& geom, const TestParams* parms,
+                                     const Real initial_time, const int initial_step)
+{
+    // the interpolated potential only contains the matter, set before any deposit
+    LocalPotentialMax potential;
+    compute_local_potential_max<NF>(state, geom, potential);
+
+    // the plotfiles show the moments of the particles, deposited separately
+    MultiFab plot_state(state.boxArray(), state.DistributionMap(), state.nComp(), state.nGrow());
+    auto write_plotfile = [&] (const Real time, const int step, const int write_plot_particles) {
+        MultiFab::Copy(plot_state, state, 0, 0, state.nComp(), state.nGrow());
+        deposit_to_mesh(neutrinos, plot_state, geom, BackgroundMoments(), false);
+        WritePlotFile(plot_state, neutrinos, geom, time, step, write_plot_particles);
+    };
+
+    if (not parms->do_restart) write_plotfile(initial_time, initial_step, 1);
+
+    amrex::Print() << "Starting timestepping loop without self-interaction... " << std::endl;
+
+    const Real start_time = amrex::second();
+    Real run_fom = 0.0;
+
+    Real time = initial_time;
+    Real dt = compute_dt<NF>(geom, parms->cfl_factor, potential, parms->flavor_cfl_factor, parms->max_adaptive_speedup);
+    for (int step = initial_step; step < parms->nsteps && time < parms->end_time; ++step) {
+        dt = std::min(dt, parms->end_time - time);
+        advance_without_self_interaction(neutrinos, state, geom, parms, dt);
+        time += dt;
+
+        RenormalizeDiagnostics renormalize_diagnostics = neutrinos.Renormalize(parms);
+
+        ReductionAggregator reductions;
+        const TimestepReductionSlots dt_slots = queue_dt_reductions(potential, parms->flavor_cfl_factor, reductions);
+        const int nparticles_slot = reductions.AddSum(neutrinos.TotalNumberOfParticles(true, true));
+        renormalize_diagnostics.Queue(reductions);
+        reductions.Start();
+
+        neutrinos.SyncLocation(Sync::CoordinateToPosition);
+        neutrinos.RedistributeLocal();
+        neutrinos.SyncLocation(Sync::PositionToCoordinate);
+
+        amrex::Print() << "Completed time step: " << step << " t = " << time << " s.  ct = " << PhysConst::c * time << " cm" << std::endl;
+
+        if (parms->angular_refine_every > 0 && (step+1) % parms->angular_refine_every == 0)
+            neutrinos.AdaptAngularResolution(parms);
+
+        const bool write_plot_particles = parms->write_plot_particles_every > 0 &&
+                                          (step+1) % parms->write_plot_particles_every == 0;
+        if ((step+1) % parms->write_plot_every == 0 || write_plot_particles)
+            write_plotfile(time, step+1, write_plot_particles);
+
+        reductions.Finish();
+        renormalize_diagnostics.Collect(reductions);
+        renormalize_diagnostics.Check(parms);
+        run_fom += reductions.Sum(nparticles_slot);
+
+        // the potential does not change, so neither does the timestep
+        dt = compute_dt<NF>(geom, parms->cfl_factor, parms->flavor_cfl_factor, parms->max_adaptive_speedup, reductions, dt_slots);
+    }
+
+    const Real advance_time = amrex::second() - start_time;
+    run_fom = run_fom / advance_time / 1.e6;
+
+    amrex::Print() << "Done. " << std::endl;
+
+    amrex::Print() << "Run time w/o initialization (seconds) = " << std::fixed << std::setprecision(3) << advance_time << std::endl;
+
+    amrex::Print() << "Average number of particles advanced per microsecond = " << std::fixed << std::setprecision(3) << run_fom << std::endl;
+}
+
+template void advance_without_self_interaction(FlavoredNeutrinoContainer<2>&, const MultiFab&, const Geometry&, const TestParams*, Real);
+template void advance_without_self_interaction(FlavoredNeutrinoContainer<3>&, const MultiFab&, const Geometry&, const TestParams*, Real);
+template void evolve_without_self_interaction(FlavoredNeutrinoContainer<2>&, MultiFab&, const Geometry&, const TestParams*, Real, int);
+template void evolve_without_self_interaction(FlavoredNeutrinoContainer<3>&, MultiFab&, const Geometry&, const TestParams*, Real, int);
@@ -0,0 +1,369 @@
+#include "Parareal.H"
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <utility>
+
+#include <AMReX.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_PlotFileUtil.H>
+
+#include "Simulation.H"
+#include "IO.H"
+#include "HermitianMatrix.H"
+#include "Realizations.H"
+
+using namespace amrex;
+
+namespace
+{
+    const std::string parareal_directory = "parareal";
+
+    // the particles of a slice boundary
+    template<int NF>
+    struct PararealState
+    {
+        std::unique_ptr<FlavoredNeutrinoContainer<NF> > particles;
+        Real time = 0;
+        int step = 0;
+    };
+
+    template<int NF>
+    PararealState<NF> copy_state(const FlavoredNeutrinoContainer<NF>& neutrinos, const Real time, const int step)
+    {
+        const int lev = 0;
+        PararealState<NF> state;
+        state.particles = std::make_unique<FlavoredNeutrinoContainer<NF> >(neutrinos.Geom(lev),
+                                                                           neutrinos.ParticleDistributionMap(lev),
+                                                                           neutrinos.ParticleBoxArray(lev));
+        state.particles->copyParticles(neutrinos, true);
+        state.time = time;
+        state.step = step;
+        return state;
+    }
+
+    // RecoverParticles only needs the time and step of the mesh data, so rho stands in for the state
+    template<int NF>
+    void write_state(const std::string& dir, const PararealState<NF>& state, const TestParams* parms)
+    {
+        const int lev = 0;
+        const FlavoredNeutrinoContainer<NF>& neutrinos = *state.particles;
+        MultiFab rho(neutrinos.ParticleBoxArray(lev), neutrinos.ParticleDistributionMap(lev), 1, 0);
+        rho.setVal(parms->rho_in);
+        WriteSingleLevelPlotfile(dir, rho, {"rho"}, neutrinos.Geom(lev), state.time, state.step);
+        neutrinos.Checkpoint(dir, "neutrinos", true, neutrinos.get_attribute_names());
+    }
+
+    // evolve the state written to start_dir until end_time
+    template<int NF>
+    PararealState<NF> propagate(const TestParams* propagator_parms, const std::string& start_dir,
+                                const Real end_time, Real& wall_time)
+    {
+        const Real start_wall_time = amrex::second();
+
+        auto parms = std::make_unique<TestParams>(*propagator_parms);
+        parms->do_restart = 1;
+        parms->restart_dir = start_dir;
+
+        EmuSimulation<NF> simulation(parms.get());
+        simulation.AdvanceTo(end_time);
+        PararealState<NF> state = copy_state(simulation.Particles(), simulation.Time(), simulation.Step());
+
+        wall_time += amrex::second() - start_wall_time;
+        return state;
+    }
+
+    // a particle keeps its id and cpu through both propagators
+    using ParticleKey = std::pair<Long, int>;
+    template<int NF>
+    using ParticleIndex = std::map<ParticleKey, const typename FlavoredNeutrinoContainer<NF>::ParticleType*>;
+
+    template<int NF>
+    ParticleIndex<NF> index_particles(const FlavoredNeutrinoContainer<NF>& neutrinos)
+    {
+        const int lev = 0;
+        ParticleIndex<NF> index;
+        for (ParConstIter<PIdx<NF>::nattribs,0,0,0> pti(neutrinos, lev); pti.isValid(); ++pti) {
+            const auto& particles = pti.GetArrayOfStructs();
+            for (int i = 0; i < pti.numParticles(); ++i) {
+                const auto& p = particles[i];
+                index[ParticleKey(Long(p.id()), int(p.cpu()))] = &p;
+            }
+        }
+        return index;
+    }
+
+    // add coarse_new - coarse_old to the flavor state of the particles. A particle
+    // that a propagator moved to another rank (by roundoff at a box boundary)
+    // keeps its uncorrected state.
+    template<int NF>
+    void apply_correction(FlavoredNeutrinoContainer<NF>& neutrinos,
+                          const FlavoredNeutrinoContainer<NF>& coarse_new,
+                          const FlavoredNeutrinoContainer<NF>& coarse_old)
+    {
+        const ParticleIndex<NF> new_index = index_particles(coarse_new);
+        const ParticleIndex<NF> old_index = index_particles(coarse_old);
+
+        const int lev = 0;
+        for (FNParIter<NF> pti(neutrinos, lev); pti.isValid(); ++pti) {
+            auto& particles = pti.GetArrayOfStructs();
+            for (int i = 0; i < pti.numParticles(); ++i) {
+                auto& p = particles[i];
+                const ParticleKey key(Long(p.id()), int(p.cpu()));
+                const auto p_new = new_index.find(key);
+                const auto p_old = old_index.find(key);
+                if (p_new == new_index.end() || p_old == old_index.end()) continue;
+                for (int n = PIdx<NF>::N; n < PIdx<NF>::nattribs; ++n)
+                    p.rdata(n) += p_new->second->rdata(n) - p_old->second->rdata(n);
+            }
+        }
+    }
+
+    // largest change of an f component of the particles on this rank
+    template<int NF>
+    Real max_flavor_change(const FlavoredNeutrinoContainer<NF>& neutrinos, const FlavoredNeutrinoContainer<NF>& previous)
+    {
+        using FlavorMatrix = HermitianMatrix<NF>;
+        const int f_start[2] = {PIdx<NF>::f00_Re, PIdx<NF>::f00_Rebar};
+        const ParticleIndex<NF> previous_index = index_particles(previous);
+
+        const int lev = 0;
+        Real change = 0;
+        for (ParConstIter<PIdx<NF>::nattribs,0,0,0> pti(neutrinos, lev); pti.isValid(); ++pti) {
+            const auto& particles = pti.GetArrayOfStructs();
+            for (int i = 0; i < pti.numParticles(); ++i) {
+                const auto& p = particles[i];
+                const auto p_previous = previous_index.find(ParticleKey(Long(p.id()), int(p.cpu())));
+                if (p_previous == previous_index.end()) continue;
+                for (int r = 0; r < NUM_REALIZATIONS; ++r)
+                    for (int tail = 0; tail < 2; ++tail)
+                        for (int c = 0; c < FlavorMatrix::ncomp; ++c) {
+                            const int n = f_start[tail] + r*realization_nattribs<NF> + c;
+                            change = std::max(change, std::abs(p.rdata(n) - p_previous->second->rdata(n)));
+                        }
+            }
+        }
+        return change;
+    }
+
+    // the groups exchange the slice states through files, signalled from
+    // the IO processor of one group to that of the next
+    void signal_slice(const int slice, const int iteration, const int ranks_per_slice)
+    {
+        ParallelDescriptor::Barrier();
+#ifdef AMREX_USE_MPI
+        if (ParallelDescriptor::IOProcessor())
+            MPI_Send(&iteration, 1, MPI_INT, slice*ranks_per_slice, iteration, MPI_COMM_WORLD);
+#else
+        amrex::ignore_unused(slice, iteration, ranks_per_slice);
+#endif
+    }
+
+    void wait_for_slice(const int slice, const int iteration, const int ranks_per_slice)
+    {
+#ifdef AMREX_USE_MPI
+        if (ParallelDescriptor::IOProcessor()) {
+            int received_iteration = 0;
+            MPI_Recv(&received_iteration, 1, MPI_INT, slice*ranks_per_slice, iteration, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+#else
+        amrex::ignore_unused(slice, iteration, ranks_per_slice);
+#endif
+        ParallelDescriptor::Barrier();
+    }
+
+    // reductions over every group
+    Real reduce_max_over_slices(Real value)
+    {
+#ifdef AMREX_USE_MPI
+        MPI_Allreduce(MPI_IN_PLACE, &value, 1, ParallelDescriptor::Mpi_typemap<Real>::type(), MPI_MAX, MPI_COMM_WORLD);
+#endif
+        return value;
+    }
+
+    Real reduce_sum_over_slices(Real value)
+    {
+#ifdef AMREX_USE_MPI
+        MPI_Allreduce(MPI_IN_PLACE, &value, 1, ParallelDescriptor::Mpi_typemap<Real>::type(), MPI_SUM, MPI_COMM_WORLD);
+#endif
+        return value;
+    }
+
+    std::string state_directory(const int iteration, const int slice)
+    {
+        return parareal_directory + "/" + amrex::Concatenate("iteration_", iteration, 5)
+                                  + amrex::Concatenate("_slice_", slice, 5);
+    }
+
+    void remove_directory(const std::string& dir)
+    {
+        ParallelDescriptor::Barrier();
+        if (ParallelDescriptor::IOProcessor()) std::filesystem::remove_all(dir);
+    }
+
+    template<int NF>
+    void iterate_slices(const int slice, const int nslices, const int ranks_per_slice, const TestParams* parms)
+    {
+        // both propagators run without output or step limit
+        auto fine_parms = std::make_unique<TestParams>(*parms);
+        fine_parms->nsteps = std::numeric_limits<int>::max();
+        fine_parms->write_plot_every = std::numeric_limits<int>::max();
+        fine_parms->write_plot_particles_every = 0;
+        auto coarse_parms = std::make_unique<TestParams>(*fine_parms);
+        coarse_parms->cfl_factor *= parms->parareal_coarse_dt_factor;
+        coarse_parms->flavor_cfl_factor *= parms->parareal_coarse_dt_factor;
+
+        // the slices divide the time from the initial state to end_time equally
+        const Real start_time = parms->do_restart ? PlotFileData(parms->restart_dir).time() : 0;
+        if (parms->end_time <= start_time) amrex::Error("parareal requires end_time after the initial time");
+        const Real slice_duration = (parms->end_time - start_time) / nslices;
+        const Real slice_end_time = slice == nslices-1 ? parms->end_time : start_time + (slice+1)*slice_duration;
+
+        // the first group initializes (or restarts) the particles exactly as a serial run
+        const std::string initial_directory = parareal_directory + "/initial";
+        if (slice == 0) {
+            EmuSimulation<NF> simulation(parms);
+            write_state(initial_directory, copy_state(simulation.Particles(), simulation.Time(), simulation.Step()), parms);
+        }
+
+        const Real start_wall_time = amrex::second();
+        Real fine_wall_time = 0, coarse_wall_time = 0, serial_estimate = 0;
+
+        // F(U(n, k-1)), G(U(n, k-1)) and U(n+1, k-1)
+        PararealState<NF> fine, coarse, end_state;
+
+        const int max_iterations = parms->parareal_max_iterations;
+        int iteration = 0;
+        bool converged = false;
+        for (; iteration < max_iterations && !converged; ++iteration) {
+            const std::string start_directory = slice == 0 ? initial_directory : state_directory(iteration, slice);
+            if (slice > 0) wait_for_slice(slice-1, iteration, ranks_per_slice);
+
+            // predict with the coarse propagator and correct with the last fine propagation
+            PararealState<NF> coarse_new = propagate<NF>(coarse_parms.get(), start_directory, slice_end_time, coarse_wall_time);
+            PararealState<NF> end_state_new;
+            if (iteration == 0) {
+                end_state_new = copy_state(*coarse_new.particles, coarse_new.time, coarse_new.step);
+            } else {
+                end_state_new = copy_state(*fine.particles, fine.time, fine.step);
+                apply_correction(*end_state_new.particles, *coarse_new.particles, *coarse.particles);
+
+                // the correction is not a physical step, so its renormalization errors are not checked
+                end_state_new.particles->Renormalize(parms);
+            }
+
+            if (slice+1 < nslices) {
+                write_state(state_directory(iteration, slice+1), end_state_new, parms);
+                signal_slice(slice+1, iteration, ranks_per_slice);
+            }
+
+            const Real change = reduce_max_over_slices(iteration == 0 ? std::numeric_limits<Real>::max() :
+                                                       max_flavor_change(*end_state_new.particles, *end_state.particles));
+            converged = change <= parms->parareal_tolerance;
+            if (iteration > 0)
+                amrex::Print() << "Parareal iteration " << iteration << ": max change of f = " << change << std::endl;
+
+            coarse = std::move(coarse_new);
+            end_state = std::move(end_state_new);
+
+            // the fine propagations of the slices run concurrently
+            if (!converged && iteration+1 < max_iterations) {
+                const Real fine_wall_time_before = fine_wall_time;
+                fine = propagate<NF>(fine_parms.get(), start_directory, slice_end_time, fine_wall_time);
+                if (iteration == 0) serial_estimate = fine_wall_time - fine_wall_time_before;
+            }
+
+            if (slice > 0) remove_directory(start_directory);
+        }
+
+        const Real wall_time = reduce_max_over_slices(amrex::second() - start_wall_time);
+        serial_estimate = reduce_sum_over_slices(ParallelDescriptor::IOProcessor() ? serial_estimate : 0);
+
+        // the last group writes the end state with its deposited moments
+        if (slice == nslices-1) {
+            const std::string final_directory = parareal_directory + "/final";
+            write_state(final_directory, end_state, parms);
+            auto final_parms = std::make_unique<TestParams>(*parms);
+            final_parms->do_restart = 1;
+            final_parms->restart_dir = final_directory;
+            EmuSimulation<NF> simulation(final_parms.get());
+            WritePlotFile(simulation.State(), simulation.Particles(), simulation.Geom(), simulation.Time(), simulation.Step(), 1);
+            remove_directory(final_directory);
+        }
+        if (slice == 0) remove_directory(initial_directory);
+
+        amrex::Print() << "Parareal " << (converged ? "converged" : "stopped") << " after " << iteration
+                       << " iterations on " << nslices << " slices" << std::endl;
+        amrex::Print() << "Parareal wall time (seconds) = " << std::fixed << std::setprecision(3) << wall_time
+                       << ", serial fine estimate = " << serial_estimate
+                       << ", speedup = " << serial_estimate / wall_time << std::endl;
+        amrex::Print() << "Coarse / fine propagation time on this slice (seconds) = "
+                       << coarse_wall_time << " / " << fine_wall_time << std::endl;
+    }
+
+    void run_slice(const int slice, const int nslices, const int ranks_per_slice)
+    {
+        // write build information to screen
+        if (ParallelDescriptor::IOProcessor()) {
+            writeBuildInfo();
+        }
+
+        // by default amrex initializes rng deterministically
+        // this uses the time for a different run each time
+        amrex::InitRandom(ParallelDescriptor::MyProc()+time(NULL), ParallelDescriptor::NProcs());
+
+        // get the run parameters
+        auto parms = std::make_unique<TestParams>();
+        parms->Initialize();
+
+        if (parms->num_flavors == 2) iterate_slices<2>(slice, nslices, ranks_per_slice, parms.get());
+        else                         iterate_slices<3>(slice, nslices, ranks_per_slice, parms.get());
+    }
+}
+
+void run_parareal(int argc, char* argv[], const int nslices)
+{
+    int world_rank = 0;
+    int nranks = 1;
+    MPI_Comm slice_comm = MPI_COMM_WORLD;
+
+#ifdef AMREX_USE_MPI
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+#endif
+    const int ranks_per_slice = nranks / nslices;
+    const int slice = world_rank / ranks_per_slice;
+    int slice_rank = world_rank % ranks_per_slice;
+#ifdef AMREX_USE_MPI
+    MPI_Comm_split(MPI_COMM_WORLD, slice, world_rank, &slice_comm);
+    MPI_Comm_rank(slice_comm, &slice_rank);
+#endif
+
+    // the groups after the first write their screen output to a file
+    std::ofstream output;
+    if (slice_rank == 0) {
+        std::filesystem::create_directories(parareal_directory);
+        if (slice > 0) output.open(parareal_directory + amrex::Concatenate("/slice_", slice, 5) + ".txt");
+    }
+
+    int slice_argc = argc;
+    char** slice_argv = argv;
+    amrex::Initialize(slice_argc, slice_argv, true, slice_comm, {},
+                      slice > 0 && slice_rank == 0 ? static_cast<std::ostream&>(output) : std::cout);
+
+    run_slice(slice, nslices, ranks_per_slice);
+
+    amrex::Finalize();
+
+#ifdef AMREX_USE_MPI
+    MPI_Comm_free(&slice_comm);
+#endif
+}
@@ -0,0 +1,132 @@
+#include "ReductionAggregator.H"
+#include <AMReX.H>
+#include <algorithm>
+#include <map>
+
+using namespace amrex;
+
+namespace
+{
+#ifdef AMREX_USE_MPI
+    // Combine two packed records. The whole record is a single MPI datatype,
+    // so MPI never splits it and the max/sum boundary stored in the first
+    // entry is always available.
+    void reduce_records(void* invec, void* inoutvec, int* len, MPI_Datatype* datatype)
+    {
+        int record_bytes;
+        MPI_Type_size(*datatype, &record_bytes);
+        const int record_size = record_bytes / sizeof(Real);
+
+        const Real* in = static_cast<const Real*>(invec);
+        Real* inout = static_cast<Real*>(inoutvec);
+
+        for (int r=0; r<*len; r++) {
+            const int nmax = static_cast<int>(in[0]);
+            for (int i=1; i<=nmax; i++)
+                inout[i] = std::max(inout[i], in[i]);
+            for (int i=nmax+1; i<record_size; i++)
+                inout[i] += in[i];
+            in += record_size;
+            inout += record_size;
+        }
+    }
+
+    // The operation and the record datatype of each size are created on first
+    // use and reused by every later reduction, until amrex::Finalize frees them.
+    MPI_Op record_op = MPI_OP_NULL;
+    std::map<int, MPI_Datatype> record_types;
+
+    void free_record_types()
+    {
+        for (auto& entry : record_types) MPI_Type_free(&entry.second);
+        record_types.clear();
+        if (record_op != MPI_OP_NULL) MPI_Op_free(&record_op);
+    }
+
+    MPI_Datatype get_record_type(const int record_size)
+    {
+        if (record_op == MPI_OP_NULL) {
+            MPI_Op_create(reduce_records, 1, &record_op);
+            amrex::ExecOnFinalize(free_record_types);
+        }
+
+        auto found = record_types.find(record_size);
+        if (found == record_types.end()) {
+            MPI_Datatype record_type;
+            MPI_Type_contiguous(record_size, ParallelDescriptor::Mpi_typemap<Real>::type(), &record_type);
+            MPI_Type_commit(&record_type);
+            found = record_types.emplace(record_size, record_type).first;
+        }
+        return found->second;
+    }
+#endif
+}
+
+ReductionAggregator::~ReductionAggregator()
+{
+    // an in-flight request must be completed before its buffer goes away
+    if (started && !finished) Finish();
+}
+
+int ReductionAggregator::AddMax(Real local_value)
+{
+    AMREX_ALWAYS_ASSERT(!started);
+    max_values.push_back(local_value);
+    return max_values.size()-1;
+}
+
+int ReductionAggregator::AddSum(Real local_value)
+{
+    AMREX_ALWAYS_ASSERT(!started);
+    sum_values.push_back(local_value);
+    return sum_values.size()-1;
+}
+
+void ReductionAggregator::Start()
+{
+    BL_PROFILE("ReductionAggregator::Start");
+
+    AMREX_ALWAYS_ASSERT(!started);
+    started = true;
+
+    buffer.resize(1 + max_values.size() + sum_values.size());
+    buffer[0] = max_values.size();
+    std::copy(max_values.begin(), max_values.end(), buffer.begin()+1);
+    std::copy(sum_values.begin(), sum_values.end(), buffer.begin()+1+max_values.size());
+
+#ifdef AMREX_USE_MPI
+    if (ParallelDescriptor::NProcs() > 1) {
+        const MPI_Datatype record_type = get_record_type(buffer.size());
+        MPI_Iallreduce(MPI_IN_PLACE, buffer.dataPtr(), 1, record_type, record_op,
+                       ParallelDescriptor::Communicator(), &request);
+    }
+#endif
+}
+
+void ReductionAggregator::Finish()
+{
+    BL_PROFILE("ReductionAggregator::Finish");
+
+    AMREX_ALWAYS_ASSERT(started && !finished);
+    finished = true;
+
+#ifdef AMREX_USE_MPI
+    if (request != MPI_REQUEST_NULL) {
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+    }
+#endif
+}
+
+Real ReductionAggregator::Max(int slot) const
+{
+    AMREX_ASSERT(finished);
+    AMREX_ASSERT(slot >= 0 && slot < max_values.size());
+    return buffer[1 + slot];
+}
+
+Real ReductionAggregator::Sum(int slot) const
+{
+    AMREX_ASSERT(finished);
+    AMREX_ASSERT(slot >= 0 && slot < sum_values.size());
+    return buffer[1 + max_values.size() + slot];
+}
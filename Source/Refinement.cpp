@@ -0,0 +1,379 @@
+#include "Refinement.H"
+#include "Evolve.H"
+#include "HermitianMatrix.H"
+#include <AMReX_Cluster.H>
+
+using namespace amrex;
+
+namespace
+{
+    // Emu's domain is periodic in every direction
+    const int is_periodic[AMREX_SPACEDIM] = {AMREX_D_DECL(1, 1, 1)};
+
+    // refine by 2 in the directions with more than one cell
+    IntVect refinement_ratio(const Geometry& geom)
+    {
+        return IntVect(AMREX_D_DECL(geom.Domain().length(0) > 1 ? 2 : 1,
+                                    geom.Domain().length(1) > 1 ? 2 : 1,
+                                    geom.Domain().length(2) > 1 ? 2 : 1));
+    }
+
+    Vector<int> domain_cells(const Geometry& geom)
+    {
+        Vector<int> ncell(AMREX_SPACEDIM);
+        for (int dir=0; dir<AMREX_SPACEDIM; dir++) ncell[dir] = geom.Domain().length(dir);
+        return ncell;
+    }
+
+    // set mask to 0 where the level of mask (on geom) is covered by fine_ba, refined by ratio
+    void clear_covered_cells(iMultiFab& mask, const BoxArray& fine_ba, const DistributionMapping& fine_dm,
+                             const IntVect& ratio, const Geometry& geom)
+    {
+        BoxArray covered = fine_ba;
+        covered.coarsen(ratio);
+        iMultiFab covered_cells(covered, fine_dm, 1, 0);
+        covered_cells.setVal(0);
+        mask.ParallelCopy(covered_cells, 0, 0, 1, IntVect(0), mask.nGrowVect(), geom.periodicity());
+    }
+}
+
+template<int NF>
+void tag_flavor_structure(const MultiFab& state, const Geometry& geom, const Real threshold, TagBoxArray& tags)
+{
+    BL_PROFILE("tag_flavor_structure");
+
+    using GIdx = ::GIdx<NF>;
+    using FlavorMatrix = HermitianMatrix<NF>;
+
+    // the differences read one ghost cell on each side
+    AMREX_ALWAYS_ASSERT(state.nGrow() >= 1);
+
+    // only look across directions that are resolved
+    const IntVect use_direction(AMREX_D_DECL(geom.Domain().length(0) > 1,
+                                             geom.Domain().length(1) > 1,
+                                             geom.Domain().length(2) > 1));
+
+#ifdef _OPENMP
+#pragma omp parallel if (Gpu::notInLaunchRegion())
+#endif
+    for (MFIter mfi(tags, TilingIfNotGPU()); mfi.isValid(); ++mfi)
+    {
+        const Box& bx = mfi.tilebox();
+        auto const& sarr = state.const_array(mfi);
+        auto const& tagarr = tags.array(mfi);
+
+        amrex::ParallelFor(bx,
+        [=] AMREX_GPU_DEVICE (int i, int j, int k)
+        {
+            auto offdiagonal_magnitude = [&] (int ii, int jj, int kk) -> Real {
+                FlavorMatrix N, Nbar;
+                N   .load(&sarr(ii,jj,kk, GIdx::N00_Re   ), static_cast<int>(sarr.nstride));
+                Nbar.load(&sarr(ii,jj,kk, GIdx::N00_Rebar), static_cast<int>(sarr.nstride));
+                return std::sqrt(N.offdiagonal_magnitude2() + Nbar.offdiagonal_magnitude2());
+            };
+
+            Real ntot = 0;
+            for (int a=0; a<NF; a++)
+                ntot += sarr(i,j,k, GIdx::N00_Re + FlavorMatrix::Re(a,a)) + sarr(i,j,k, GIdx::N00_Rebar + FlavorMatrix::Re(a,a));
+
+            Real variation = 0;
+            for (int dir=0; dir<AMREX_SPACEDIM; dir++) {
+                if (!use_direction[dir]) continue;
+                const IntVect shift = IntVect::TheDimensionVector(dir);
+                variation = amrex::max(variation, 0.5*std::abs(offdiagonal_magnitude(i+shift[0], j+shift[1], k+shift[2]) -
+                                                               offdiagonal_magnitude(i-shift[0], j-shift[1], k-shift[2])));
+            }
+
+            if (variation > threshold*ntot) tagarr(i,j,k) = TagBox::SET;
+        });
+    }
+}
+
+template<int NF>
+void report_refinement(const MultiFab& state, const Geometry& geom, const TestParams* parms)
+{
+    BL_PROFILE("report_refinement");
+
+    TagBoxArray tags(state.boxArray(), state.DistributionMap(), 1);
+    tags.setVal(TagBox::CLEAR);
+    tag_flavor_structure<NF>(state, geom, parms->amr_tag_threshold, tags);
+
+    // add a buffer of one cell around the tags, as AmrMesh does before regridding
+    tags.buffer(IntVect(1));
+
+    Gpu::PinnedVector<IntVect> tagged_cells;
+    tags.collate(tagged_cells);
+
+    if (ParallelDescriptor::IOProcessor()) {
+        const Long ntagged = tagged_cells.size();
+        Long ncovered = 0;
+        int nboxes = 0;
+        if (ntagged > 0) {
+            // cluster with the default AmrMesh grid efficiency
+            const Real grid_efficiency = 0.7;
+            ClusterList clist(tagged_cells.data(), ntagged);
+            clist.chop(grid_efficiency);
+            BoxList fine_boxes = clist.boxList();
+            fine_boxes.intersect(geom.Domain());
+            fine_boxes.simplify();
+            nboxes = fine_boxes.size();
+            for (const Box& b : fine_boxes) ncovered += b.numPts();
+        }
+        amrex::Print() << "  Refinement: " << ntagged << " tagged cells, " << nboxes
+                       << " projected fine grids covering " << 100.*ncovered/geom.Domain().numPts()
+                       << "% of the domain" << std::endl;
+    }
+}
+
+template<int NF>
+RefinedMesh<NF>::RefinedMesh(const Geometry& geom, MultiFab& a_state, const TestParams* a_parms)
+    : AmrCore(&geom.ProbDomain(), a_parms->amr_max_level, domain_cells(geom), CoordSys::cartesian,
+              Vector<IntVect>(a_parms->amr_max_level, refinement_ratio(geom)), is_periodic),
+      parms(a_parms),
+      state0(a_state),
+      state_ngrow(a_state.nGrowVect())
+{
+    // the grids of each finer level must coarsen to cells of the level below
+    SetBlockingFactor(refinement_ratio(geom));
+    SetMaxGridSize(parms->max_grid_size);
+
+    state.resize(max_level+1);
+    particle_mesh.resize(max_level+1);
+    box_index.resize(max_level+1);
+    particle_mask.resize(max_level+1);
+
+    // level 0 is not built by AmrCore
+    SetBoxArray(0, state0.boxArray());
+    SetDistributionMap(0, state0.DistributionMap());
+    SetFinestLevel(0);
+    MakeParticleLevels();
+}
+
+template<int NF>
+void RefinedMesh<NF>::Regrid(const Real time)
+{
+    BL_PROFILE("RefinedMesh::Regrid");
+
+    regrid(0, time);
+    MakeParticleLevels();
+
+    if (finest_level == 0) amrex::Print() << "  Refinement: no tagged cells, level 0 only" << std::endl;
+    for (int lev = 1; lev <= finest_level; ++lev) {
+        amrex::Print() << "  Refinement: level " << lev << " has " << boxArray(lev).size() << " grids covering "
+                       << 100.*boxArray(lev).numPts()/Geom(lev).Domain().numPts() << "% of the domain" << std::endl;
+    }
+}
+
+template<int NF>
+void RefinedMesh<NF>::Deposit(const FlavoredNeutrinoContainer<NF>& neutrinos)
+{
+    BL_PROFILE("RefinedMesh::Deposit");
+
+    const int start_comp = GIdx<NF>::N00_Re;
+    const int num_comps = GIdx<NF>::ncomp - start_comp;
+
+    for (int lev = 1; lev <= finest_level; ++lev) {
+        const Periodicity period = Geom(lev).periodicity();
+
+        // the matter components come before the moments
+        FillFromCoarse(lev, state[lev], start_comp);
+
+        // each copy holds the particles of one level-0 box, and overlaps the others in its ghost cells
+        deposit_to_level(neutrinos, particle_mesh[lev], box_index[lev], Geom(lev));
+        state[lev].setVal(0.0, start_comp, num_comps, state_ngrow);
+        state[lev].ParallelAdd(particle_mesh[lev], start_comp, start_comp, num_comps,
+                               particle_mesh[lev].nGrowVect(), state_ngrow, period);
+
+        // the particles read the summed moments and the matter back through the copy
+        particle_mesh[lev].setVal(0.0);
+        particle_mesh[lev].ParallelCopy(state[lev], 0, 0, GIdx<NF>::ncomp, state_ngrow, particle_mesh[lev].nGrowVect(), period);
+    }
+}
+
+template<int NF>
+Vector<ParticleMeshLevel> RefinedMesh<NF>::ParticleLevels() const
+{
+    Vector<ParticleMeshLevel> levels(finest_level+1);
+    levels[0].mesh = &state0;
+    levels[0].mask = finest_level > 0 ? &particle_mask[0] : nullptr;
+    levels[0].geom = Geom(0);
+    for (int lev = 1; lev <= finest_level; ++lev) {
+        levels[lev].mesh = &particle_mesh[lev];
+        levels[lev].mask = &particle_mask[lev];
+        levels[lev].box_index = &box_index[lev];
+        levels[lev].geom = Geom(lev);
+    }
+    return levels;
+}
+
+template<int NF>
+void RefinedMesh<NF>::MaxLocalPotential(LocalPotentialMax& potential) const
+{
+    for (int lev = 1; lev <= finest_level; ++lev) {
+        LocalPotentialMax level_potential;
+        compute_local_potential_max<NF>(state[lev], Geom(lev), level_potential);
+        potential.V_adaptive = amrex::max(potential.V_adaptive, level_potential.V_adaptive);
+        potential.V_stupid   = amrex::max(potential.V_stupid,   level_potential.V_stupid  );
+    }
+}
+
+template<int NF>
+void RefinedMesh<NF>::MakeNewLevelFromScratch(int /*lev*/, Real /*time*/, const BoxArray& /*ba*/, const DistributionMapping& /*dm*/)
+{
+    amrex::Error("RefinedMesh: level 0 is the state of EmuSimulation and is never rebuilt");
+}
+
+template<int NF>
+void RefinedMesh<NF>::MakeNewLevelFromCoarse(const int lev, Real /*time*/, const BoxArray& ba, const DistributionMapping& dm)
+{
+    state[lev] = MultiFab(ba, dm, GIdx<NF>::ncomp, state_ngrow);
+    FillFromCoarse(lev, state[lev], GIdx<NF>::ncomp);
+}
+
+template<int NF>
+void RefinedMesh<NF>::RemakeLevel(const int lev, Real /*time*/, const BoxArray& ba, const DistributionMapping& dm)
+{
+    MultiFab new_state(ba, dm, GIdx<NF>::ncomp, state_ngrow);
+    FillFromCoarse(lev, new_state, GIdx<NF>::ncomp);
+
+    // keep the last deposit where the level overlaps its old grids
+    new_state.ParallelCopy(state[lev], 0, 0, GIdx<NF>::ncomp, state_ngrow, state_ngrow, Geom(lev).periodicity());
+    std::swap(state[lev], new_state);
+}
+
+template<int NF>
+void RefinedMesh<NF>::ClearLevel(const int lev)
+{
+    state[lev].clear();
+    particle_mesh[lev].clear();
+    particle_mask[lev].clear();
+    box_index[lev].clear();
+}
+
+template<int NF>
+void RefinedMesh<NF>::ErrorEst(const int lev, TagBoxArray& tags, Real /*time*/, int /*ngrow*/)
+{
+    tag_flavor_structure<NF>(State(lev), Geom(lev), parms->amr_tag_threshold, tags);
+}
+
+template<int NF>
+IntVect RefinedMesh<NF>::ParticleGhostCells(const int lev) const
+{
+    // the level cells per level-0 cell
+    IntVect ratio(1);
+    for (int l = 0; l < lev; ++l) ratio *= refRatio(l);
+
+    // state_ngrow is one cell more than the shape factors reach
+    IntVect ngrow = state_ngrow - 1;
+    for (int dir=0; dir<AMREX_SPACEDIM; dir++)
+        if (Geom(0).Domain().length(dir) > 1) ngrow[dir] += ratio[dir];
+    return ngrow;
+}
+
+template<int NF>
+void RefinedMesh<NF>::FillFromCoarse(const int lev, MultiFab& mf, const int ncomp) const
+{
+    const IntVect ratio = refRatio(lev-1);
+    const Real inv_fine_cells = 1.0/ratio.product();
+    const MultiFab& coarse_state = lev == 1 ? state0 : state[lev-1];
+
+    // the coarse cells under mf, ghost cells included
+    BoxArray coarse_ba = mf.boxArray();
+    coarse_ba.coarsen(ratio);
+    MultiFab coarse(coarse_ba, mf.DistributionMap(), ncomp, mf.nGrowVect());
+    coarse.setVal(0.0);
+    coarse.ParallelCopy(coarse_state, 0, 0, ncomp, coarse_state.nGrowVect(), coarse.nGrowVect(), Geom(lev-1).periodicity());
+
+#ifdef _OPENMP
+#pragma omp parallel if (Gpu::notInLaunchRegion())
+#endif
+    for (MFIter mfi(mf, TilingIfNotGPU()); mfi.isValid(); ++mfi)
+    {
+        const Box& bx = mfi.growntilebox();
+        auto const& fine = mf.array(mfi);
+        auto const& crse = coarse.const_array(mfi);
+
+        amrex::ParallelFor(bx, ncomp,
+        [=] AMREX_GPU_DEVICE (int i, int j, int k, int n)
+        {
+            const IntVect iv = amrex::coarsen(IntVect(AMREX_D_DECL(i,j,k)), ratio);
+            fine(i,j,k,n) = crse(iv[0],iv[1],iv[2],n) * (n < GIdx<NF>::N00_Re ? 1.0 : inv_fine_cells);
+        });
+    }
+}
+
+template<int NF>
+void RefinedMesh<NF>::MakeParticleLevels()
+{
+    BL_PROFILE("RefinedMesh::MakeParticleLevels");
+
+    const BoxArray& ba0 = boxArray(0);
+    const DistributionMapping& dm0 = DistributionMap(0);
+
+    // level 0 advances the particles outside level 1
+    particle_mask[0] = iMultiFab(ba0, dm0, 1, state_ngrow);
+    particle_mask[0].setVal(1);
+    if (finest_level > 0) clear_covered_cells(particle_mask[0], boxArray(1), DistributionMap(1), refRatio(0), Geom(0));
+
+    for (int lev = 1; lev <= finest_level; ++lev) {
+        const BoxArray& ba = boxArray(lev);
+        const Box& domain = Geom(lev).Domain();
+        IntVect ratio(1);
+        for (int l = 0; l < lev; ++l) ratio *= refRatio(l);
+
+        // The particles of a level-0 box reach ngrow cells out of it, and
+        // deposit into the ghost cells of the level up to reach cells from its grids
+        const IntVect ngrow = ParticleGhostCells(lev);
+        const IntVect reach = state_ngrow + ngrow;
+
+        // the periodic images of the level
+        Vector<IntVect> shifts;
+        for (int k=-1; k<=1; k++)
+            for (int j=-1; j<=1; j++)
+                for (int i=-1; i<=1; i++)
+                    shifts.push_back(IntVect(AMREX_D_DECL(i*domain.length(0), j*domain.length(1), k*domain.length(2))));
+
+        // one box per level-0 box, around the part of it the level reaches
+        BoxList boxes;
+        Vector<int> owners;
+        box_index[lev].assign(ba0.size(), -1);
+        for (int b = 0; b < ba0.size(); ++b) {
+            const Box region = amrex::refine(ba0[b], ratio);
+            Box cover;
+            bool found = false;
+            for (const IntVect& shift : shifts) {
+                for (const auto& isect : ba.intersections(amrex::grow(region, reach) - shift)) {
+                    const Box touched = (amrex::grow(ba[isect.first], reach) + shift) & region;
+                    if (found) cover.minBox(touched);
+                    else cover = touched;
+                    found = true;
+                }
+            }
+            if (!found) continue;
+            box_index[lev][b] = owners.size();
+            boxes.push_back(cover);
+            owners.push_back(dm0[b]);
+        }
+
+        const BoxArray particle_ba(boxes);
+        const DistributionMapping particle_dm(owners);
+        particle_mesh[lev] = MultiFab(particle_ba, particle_dm, GIdx<NF>::ncomp, ngrow);
+        particle_mesh[lev].setVal(0.0);
+
+        // 1 on the cells of the level, including its periodic images in the ghost cells,
+        // unless the next level covers them
+        particle_mask[lev] = iMultiFab(particle_ba, particle_dm, 1, ngrow);
+        particle_mask[lev].setVal(0);
+        iMultiFab level_cells(ba, DistributionMap(lev), 1, 0);
+        level_cells.setVal(1);
+        particle_mask[lev].ParallelCopy(level_cells, 0, 0, 1, IntVect(0), ngrow, Geom(lev).periodicity());
+        if (lev < finest_level) clear_covered_cells(particle_mask[lev], boxArray(lev+1), DistributionMap(lev+1), refRatio(lev), Geom(lev));
+    }
+}
+
+template void tag_flavor_structure<2>(const MultiFab&, const Geometry&, Real, TagBoxArray&);
+template void tag_flavor_structure<3>(const MultiFab&, const Geometry&, Real, TagBoxArray&);
+template void report_refinement<2>(const MultiFab&, const Geometry&, const TestParams*);
+template void report_refinement<3>(const MultiFab&, const Geometry&, const TestParams*);
+template class RefinedMesh<2>;
+template class RefinedMesh<3>;
@@ -0,0 +1,106 @@
+#include "SaturationMonitor.H"
+#include "Evolve.H"
+#include "HermitianMatrix.H"
+#include <cmath>
+
+using namespace amrex;
+
+SaturationMonitor::SaturationMonitor(const TestParams* parms)
+    : fit_window(parms->saturation_fit_window),
+      rate_fraction(parms->saturation_rate_fraction),
+      stop_after(parms->saturation_stop_after)
+{
+    AMREX_ALWAYS_ASSERT(fit_window >= 2);
+}
+
+template<int NF>
+void SaturationMonitor::Queue(const MultiFab& state, ReductionAggregator& reductions)
+{
+    BL_PROFILE("SaturationMonitor::Queue");
+
+    using FlavorMatrix = HermitianMatrix<NF>;
+
+    ReduceOps<ReduceOpMax> reduce_op;
+    ReduceData<Real> reduce_data(reduce_op);
+    using ReduceTuple = typename decltype(reduce_data)::Type;
+
+    for (MFIter mfi(state); mfi.isValid(); ++mfi) {
+        const Box& bx = mfi.validbox();
+        auto const& sarr = state.const_array(mfi);
+        reduce_op.eval(bx, reduce_data,
+        [=] AMREX_GPU_DEVICE (int i, int j, int k) -> ReduceTuple {
+            FlavorMatrix N, Nbar;
+            N   .load(&sarr(i,j,k, GIdx<NF>::N00_Re   ), static_cast<int>(sarr.nstride));
+            Nbar.load(&sarr(i,j,k, GIdx<NF>::N00_Rebar), static_cast<int>(sarr.nstride));
+            return {N.offdiagonal_magnitude2() + Nbar.offdiagonal_magnitude2()};
+        });
+    }
+
+    slot = reductions.AddMax(std::sqrt(amrex::get<0>(reduce_data.value())));
+}
+
+template void SaturationMonitor::Queue<2>(const MultiFab&, ReductionAggregator&);
+template void SaturationMonitor::Queue<3>(const MultiFab&, ReductionAggregator&);
+
+Real SaturationMonitor::FitGrowthRate() const
+{
+    const int n = sample_time.size();
+    Real tmean = 0, ymean = 0;
+    for (int i=0; i<n; i++) {
+        tmean += sample_time[i];
+        ymean += sample_logA[i];
+    }
+    tmean /= n;
+    ymean /= n;
+
+    Real covariance = 0, variance = 0;
+    for (int i=0; i<n; i++) {
+        covariance += (sample_time[i]-tmean) * (sample_logA[i]-ymean);
+        variance   += (sample_time[i]-tmean) * (sample_time[i]-tmean);
+    }
+    return variance > 0 ? covariance/variance : 0;
+}
+
+void SaturationMonitor::Collect(const ReductionAggregator& reductions, const Real time)
+{
+    const Real amplitude = reductions.Max(slot);
+    if (amplitude <= 0) return;
+
+    sample_time.push_back(time);
+    sample_logA.push_back(std::log(amplitude));
+    if (static_cast<int>(sample_time.size()) > fit_window) {
+        sample_time.pop_front();
+        sample_logA.pop_front();
+    }
+
+    // the growth is measured from the smallest amplitude of any sample, window full or not
+    min_logA = amrex::min(min_logA, sample_logA.back());
+    if (static_cast<int>(sample_time.size()) < fit_window) return;
+
+    const Real rate = FitGrowthRate();
+    max_growth_rate = amrex::max(max_growth_rate, rate);
+
+    // only look for saturation once the perturbation has grown by a factor of 10
+    const bool has_grown = sample_logA.back() - min_logA > std::log(10.);
+    if (!saturated && has_grown && max_growth_rate > 0 && rate < rate_fraction*max_growth_rate) {
+        saturated = true;
+        saturation_time = time;
+        saturation_amplitude = amplitude;
+        amrex::Print() << "  Saturation detected at t = " << time << " s with max off-diagonal N = " << amplitude
+                       << ". Linear growth rate = " << max_growth_rate << " 1/s" << std::endl;
+    }
+}
+
+bool SaturationMonitor::ShouldStop(const Real time) const
+{
+    return saturated && stop_after >= 0 && time >= saturation_time + stop_after;
+}
+
+void SaturationMonitor::PrintSummary() const
+{
+    amrex::Print() << "Linear growth rate of the off-diagonal N = " << max_growth_rate << " 1/s" << std::endl;
+    if (saturated)
+        amrex::Print() << "Saturated at t = " << saturation_time << " s with max off-diagonal N = " << saturation_amplitude << std::endl;
+    else
+        amrex::Print() << "Saturation was not detected" << std::endl;
+}
@@ -0,0 +1,382 @@
+#include "Simulation.H"
+
+#include "Constants.H"
+#include "IO.H"
+#include "ReductionAggregator.H"
+#include "Stability.H"
+#include "AngularDecomposition.H"
+
+using namespace amrex;
+
+namespace
+{
+    // Define the index space of the domain, broken up into chunks no larger
+    // than max_grid_size along a direction
+    BoxArray make_box_array(const TestParams* parms)
+    {
+        const IntVect domain_lo(AMREX_D_DECL(0, 0, 0));
+        const IntVect domain_hi(AMREX_D_DECL(parms->ncell[0]-1,parms->ncell[1]-1,parms->ncell[2]-1));
+        BoxArray ba(Box(domain_lo, domain_hi));
+        ba.maxSize(parms->max_grid_size);
+        return ba;
+    }
+
+    // Periodic in all dimensions, [0,L] in each dimension
+    Geometry make_geometry(const TestParams* parms)
+    {
+        Vector<int> is_periodic(AMREX_SPACEDIM, 1);
+        const IntVect domain_lo(AMREX_D_DECL(0, 0, 0));
+        const IntVect domain_hi(AMREX_D_DECL(parms->ncell[0]-1,parms->ncell[1]-1,parms->ncell[2]-1));
+        RealBox real_box({AMREX_D_DECL(     0.0,      0.0,      0.0)},
+                         {AMREX_D_DECL(parms->Lx, parms->Ly, parms->Lz)});
+        return Geometry(Box(domain_lo, domain_hi), &real_box, CoordSys::cartesian, is_periodic.data());
+    }
+
+    // (with the angular decomposition every rank holds every box)
+    DistributionMapping make_distribution_mapping(const BoxArray& ba, const TestParams* parms)
+    {
+        return parms->angular_decomposition ? replicated_distribution_mapping(ba) : DistributionMapping(ba);
+    }
+}
+
+template<int NF>
+EmuSimulation<NF>::EmuSimulation(const TestParams* a_parms)
+    : parms(a_parms),
+      geom(make_geometry(a_parms)),
+      ba(make_box_array(a_parms)),
+      dm(make_distribution_mapping(ba, a_parms)),
+      filter(geom, a_parms->filter_npass, a_parms->filter_compensate),
+      neutrinos_old(geom, dm, ba),
+      neutrinos_new(geom, dm, ba)
+{
+    // We want ghost cells according to size of particle shape stencil (grids are "grown" by ngrow ghost cells in each direction)
+    // An order-n spline reaches (n+1)/2 cells past the particle's cell, plus one cell for particles that move during a step
+    const IntVect shape_factor_order_vec(AMREX_D_DECL(parms->ncell[0]==1 ? 0 : SHAPE_FACTOR_ORDER,
+                                                      parms->ncell[1]==1 ? 0 : SHAPE_FACTOR_ORDER,
+                                                      parms->ncell[2]==1 ? 0 : SHAPE_FACTOR_ORDER));
+    const IntVect ngrow(1 + (1+shape_factor_order_vec)/2);
+    for(int i=0; i<AMREX_SPACEDIM; i++) AMREX_ASSERT(parms->ncell[i] >= ngrow[i]);
+
+    const int ncomp = GIdx<NF>::ncomp;
+
+    // Create a MultiFab to hold our grid state data and initialize to 0.0
+    state.define(ba, dm, ncomp, ngrow);
+    state.setVal(0.0);
+    state.setVal(parms->rho_in,GIdx<NF>::rho,1); // g/ccm
+    state.setVal(parms->Ye_in,GIdx<NF>::Ye,1);
+    state.setVal(parms->T_in,GIdx<NF>::T,1); // MeV
+    state.FillBoundary(geom.periodicity());
+
+    // initialize the grid variable names
+    GIdx<NF>::Initialize();
+
+    if (parms->angular_decomposition) distributed_state.define(ba, DistributionMapping(ba), ncomp, ngrow);
+
+    if (parms->filter_npass > 0) filter.PrintTransferFunction();
+
+    // Initialize particles on the domain
+    amrex::Print() << "Initializing particles... ";
+
+    if(parms->do_restart){
+        // get particle data from file
+        RecoverParticles(parms->restart_dir, neutrinos_old, initial_time, initial_step);
+    }
+    else{
+    	// Initialize old particles
+    	neutrinos_old.InitParticles(parms);
+
+    	// Remove particles that barely contribute
+    	if (parms->cull_weight_fraction > 0) neutrinos_old.CullLowWeightParticles(parms);
+    }
+
+    // The other engines are run by their own drivers from the initial particles
+    if (parms->engine != "particles" || !parms->self_interaction) {
+        amrex::Print() << "Done. " << std::endl;
+        return;
+    }
+
+    // Copy particles from old data to new data
+    // (the second argument is true to indicate particle container data is local
+    //  and we can skip calling Redistribute() after copying the particles)
+    neutrinos_new.copyParticles(neutrinos_old, true);
+
+    // In delta-f mode the background moments are added on the mesh instead of
+    // being deposited by the particles
+    if (parms->delta_f) {
+        background = compute_background_moments(neutrinos_old, geom);
+        if (not parms->do_restart) check_uniform_background(neutrinos_old, state, geom, background, parms->angular_decomposition);
+    }
+
+    // Deposit particles to grid
+    deposit_to_mesh(neutrinos_old, state, geom, background, parms->angular_decomposition);
+
+    // In the hybrid mode the flavor-stable boxes start as moments (or as
+    // saved in the restart plotfile), and the deposit is redone with them
+    if (parms->hybrid_every > 0) {
+        hybrid = std::make_unique<HybridMoments<NF> >(geom, ba, dm, neutrinos_old, parms, initial_time);
+        if (!parms->do_restart || !hybrid->ReadCheckpoint(parms->restart_dir))
+            hybrid->Switch(state, neutrinos_old);
+        Deposit(neutrinos_old);
+        neutrinos_new.copyParticles(neutrinos_old, true);
+    }
+
+    // Build the finer levels one at a time, each tagged from the deposit on the level below
+    if (parms->amr_tag_every > 0) {
+        state.FillBoundary(geom.periodicity());
+        refined_mesh = std::make_unique<RefinedMesh<NF> >(geom, state, parms);
+        for (int lev = 0; lev < parms->amr_max_level; ++lev) {
+            refined_mesh->Regrid(initial_time);
+            if (refined_mesh->finestLevel() == lev) break;
+            refined_mesh->Deposit(neutrinos_old);
+        }
+    }
+
+    // keep the local potential maxima for the first timestep
+    ComputeLocalPotentialMax();
+
+    // Write plotfile after initialization
+    if (not parms->do_restart) {
+        // If we have just initialized, then always save the particle data for reference
+        // (the angular decomposition cannot write the particles)
+        const int write_particles_after_init = parms->angular_decomposition ? 0 : 1;
+        WritePlot(neutrinos_old, initial_time, initial_step, write_particles_after_init);
+    }
+
+    amrex::Print() << "Done. " << std::endl;
+
+    integrator = std::make_unique<TimeIntegrator<FlavoredNeutrinoContainer<NF> >>(neutrinos_old, neutrinos_new, initial_time, initial_step);
+
+    // Optionally follow the growth of the instability and stop after it saturates
+    if (parms->saturation_monitor) saturation_monitor = std::make_unique<SaturationMonitor>(parms);
+
+    // Attach our RHS and post timestep hooks to the integrator
+    integrator->set_rhs([this] (FlavoredNeutrinoContainer<NF>& neutrinos_rhs, const FlavoredNeutrinoContainer<NF>& neutrinos, Real /*time*/) {
+        ComputeRHS(neutrinos_rhs, neutrinos);
+    });
+    integrator->set_post_timestep([this] () { PostTimestep(); });
+
+    // Get a starting timestep
+    dt = compute_dt<NF>(geom,parms->cfl_factor,potential,parms->flavor_cfl_factor, parms->max_adaptive_speedup);
+}
+
+template<int NF>
+FlavoredNeutrinoContainer<NF>& EmuSimulation<NF>::Particles()
+{
+    return integrator ? integrator->get_new_data() : neutrinos_old;
+}
+
+template<int NF>
+Real EmuSimulation<NF>::Time() const
+{
+    return integrator ? integrator->get_time() : initial_time;
+}
+
+template<int NF>
+int EmuSimulation<NF>::Step() const
+{
+    return integrator ? integrator->get_step_number() : initial_step;
+}
+
+template<int NF>
+bool EmuSimulation<NF>::AdvanceTo(const Real target_time)
+{
+    if (!integrator)
+        amrex::Error("EmuSimulation::AdvanceTo requires engine = particles and self_interaction = 1");
+
+    if (finished || Step() >= parms->nsteps) return false;
+    if (target_time <= Time()) return true;
+
+    // Do all the science!
+    // (integrate counts its steps from 0 on every call, so pass the steps left)
+    try {
+        integrator->integrate(dt, target_time, parms->nsteps - Step());
+    } catch (const SaturationReached&) {
+        amrex::Print() << "Stopping " << parms->saturation_stop_after << " s after saturation." << std::endl;
+        finished = true;
+    }
+
+    return !finished && Step() < parms->nsteps;
+}
+
+template<int NF>
+void EmuSimulation<NF>::DepositMoments()
+{
+    Deposit(Particles());
+}
+
+template<int NF>
+void EmuSimulation<NF>::PrintSummary() const
+{
+    if (saturation_monitor) saturation_monitor->PrintSummary();
+}
+
+template<int NF>
+const MultiFab& EmuSimulation<NF>::OutputState()
+{
+    if (!parms->angular_decomposition) return state;
+    copy_replicated_to_distributed(state, distributed_state);
+    distributed_state.FillBoundary(geom.periodicity());
+    return distributed_state;
+}
+
+template<int NF>
+void EmuSimulation<NF>::Deposit(const FlavoredNeutrinoContainer<NF>& neutrinos)
+{
+    deposit_to_mesh(neutrinos, state, geom, background, parms->angular_decomposition);
+    state.FillBoundary(geom.periodicity());
+    if (parms->filter_npass > 0) filter.Apply(state, geom);
+    if (hybrid) hybrid->AddMoments(state);
+    if (refined_mesh) refined_mesh->Deposit(neutrinos);
+}
+
+template<int NF>
+void EmuSimulation<NF>::ComputeLocalPotentialMax()
+{
+    compute_local_potential_max<NF>(state, geom, potential);
+    if (refined_mesh) refined_mesh->MaxLocalPotential(potential);
+}
+
+template<int NF>
+void EmuSimulation<NF>::WritePlot(const FlavoredNeutrinoContainer<NF>& neutrinos, const Real time, const int step, const int write_plot_particles)
+{
+    if (!refined_mesh) {
+        WritePlotFile(OutputState(), neutrinos, geom, time, step, write_plot_particles);
+        // the moments belong with the particles for a restart
+        if (hybrid && write_plot_particles) hybrid->WriteCheckpoint(amrex::Concatenate("plt", step));
+        return;
+    }
+
+    const int nlevels = refined_mesh->finestLevel() + 1;
+    Vector<const MultiFab*> level_states;
+    for (int lev = 0; lev < nlevels; ++lev) level_states.push_back(&refined_mesh->State(lev));
+    WritePlotFile(level_states, neutrinos, refined_mesh->Geom(), refined_mesh->refRatio(), time, step, write_plot_particles);
+}
+
+template<int NF>
+void EmuSimulation<NF>::ComputeRHS(FlavoredNeutrinoContainer<NF>& neutrinos_rhs, const FlavoredNeutrinoContainer<NF>& neutrinos)
+{
+    /* Evaluate the neutrino distribution matrix RHS */
+
+    // Step 1: Deposit Particle Data to Mesh & fill domain boundaries/ghost cells
+    Deposit(neutrinos);
+
+    // Step 2: Copy Particles and their F from neutrino state to neutrino RHS ParticleContainer
+    //
+    // This is necessary for two reasons:
+    //
+    // A) We evaluate the Hamiltonians in the interpolation step for efficiency. This requires
+    //    us to know F for each particle so we can calculate its RHS.
+    // B) We only Redistribute the integrator new data at the end of the timestep, not all the RHS data.
+    //    Thus, this copy clears the old RHS particles and creates particles in the RHS container corresponding
+    //    to the current particles in neutrinos.
+    neutrinos_rhs.copyParticles(neutrinos, true);
+
+    // Step 3: Interpolate Mesh to construct the neutrino RHS in place
+    if (refined_mesh) interpolate_rhs_from_mesh(neutrinos_rhs, refined_mesh->ParticleLevels(), parms);
+    else interpolate_rhs_from_mesh(neutrinos_rhs, state, geom, parms);
+}
+
+template<int NF>
+void EmuSimulation<NF>::PostTimestep()
+{
+    /* Post-timestep function. The integrator new-time data is the latest data available. */
+
+    // Get the latest neutrino data
+    auto& neutrinos = integrator->get_new_data();
+
+    // Renormalize the neutrino state.
+    // Any errors are reported below once the diagnostics are reduced across ranks.
+    RenormalizeDiagnostics renormalize_diagnostics = neutrinos.Renormalize(parms);
+
+    // Advance the moments of the hybrid mode over the same step, with the
+    // particle deposit of the last stage
+    if (hybrid) hybrid->AdvanceTo(state, integrator->get_time());
+
+    // Reduce the potentials for the next timestep over the valid cells of the last deposit.
+    // Note: this won't be the same as the new-time grid data
+    // because the last deposit_to_mesh call was at either the old time (forward Euler)
+    // or the final RK stage, if using Runge-Kutta. The earlier stages need no reduction.
+    ComputeLocalPotentialMax();
+
+    // Queue this step's global reductions and post them as one non-blocking
+    // collective that completes while we update the particles below:
+    // - the potential maxima for the next timestep
+    // - the number of particles advanced, for the figure of merit
+    // - the renormalization errors
+    ReductionAggregator reductions;
+    const TimestepReductionSlots dt_slots = queue_dt_reductions(potential, parms->flavor_cfl_factor, reductions);
+    const int nparticles_slot = reductions.AddSum(neutrinos.TotalNumberOfParticles(true, true));
+    renormalize_diagnostics.Queue(reductions);
+    if (saturation_monitor) saturation_monitor->Queue<NF>(state, reductions);
+    reductions.Start();
+
+    // Update the new time particle locations in the domain with their
+    // integrated coordinates.
+    neutrinos.SyncLocation(Sync::CoordinateToPosition);
+
+    // Now Redistribute the new time particles to their new grids.
+    neutrinos.RedistributeLocal();
+
+    // Update the integrated coordinates with the new particle locations
+    // since Redistribute() applies periodic boundary conditions.
+    neutrinos.SyncLocation(Sync::PositionToCoordinate);
+
+    // Get which step the integrator is on
+    const int step = integrator->get_step_number();
+    const Real time = integrator->get_time();
+
+    amrex::Print() << "Completed time step: " << step << " t = " << time << " s.  ct = " << PhysConst::c * time << " cm" << std::endl;
+
+    // Rebuild the finer levels around the flavor structure of the last deposit
+    if (refined_mesh && (step+1) % parms->amr_tag_every == 0)
+        refined_mesh->Regrid(time);
+
+    // Report which boxes are flavor-stable according to the ELN crossing test
+    if (parms->eln_crossing_check_every > 0 && (step+1) % parms->eln_crossing_check_every == 0)
+        report_eln_crossings(state, neutrinos);
+
+    // Convert the neutrinos of each box to particles or moments according to its ELN crossings
+    if (hybrid && (step+1) % parms->hybrid_every == 0)
+        hybrid->Switch(state, neutrinos);
+
+    // Adapt the angular resolution to the flavor structure
+    if (parms->angular_refine_every > 0 && (step+1) % parms->angular_refine_every == 0)
+        neutrinos.AdaptAngularResolution(parms);
+
+    // Write the Mesh Data to Plotfile if required
+    const bool write_plot = (step+1) % parms->write_plot_every == 0 ||
+        (parms->write_plot_particles_every > 0 &&
+         (step+1) % parms->write_plot_particles_every == 0);
+    if (write_plot) {
+        // Only include the Particle Data if write_plot_particles_every is satisfied
+        int write_plot_particles = parms->write_plot_particles_every > 0 &&
+                                   (step+1) % parms->write_plot_particles_every == 0;
+        WritePlot(neutrinos, time, step+1, write_plot_particles);
+
+        // Measure the noise that delta-f removes from the moments
+        if (parms->delta_f) report_delta_f_noise(neutrinos, state, geom, background, parms->angular_decomposition);
+    }
+
+    // Wait for the global reductions to complete
+    reductions.Finish();
+
+    renormalize_diagnostics.Collect(reductions);
+    renormalize_diagnostics.Check(parms);
+
+    run_fom += reductions.Sum(nparticles_slot);
+
+    if (saturation_monitor) saturation_monitor->Collect(reductions, time);
+
+    // Set the next timestep from the reduced potentials
+    dt = compute_dt<NF>(geom, parms->cfl_factor, parms->flavor_cfl_factor, parms->max_adaptive_speedup, reductions, dt_slots);
+    integrator->set_timestep(dt);
+
+    // End the run once the post-saturation interval has passed, keeping the final state
+    if (saturation_monitor && saturation_monitor->ShouldStop(time)) {
+        if (!write_plot) WritePlot(neutrinos, time, step+1, 0);
+        throw SaturationReached();
+    }
+}
+
+template class EmuSimulation<2>;
+template class EmuSimulation<3>;
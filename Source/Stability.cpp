@@ -0,0 +1,130 @@
+#include "Stability.H"
+#include "Evolve.H"
+#include "DirectionSets.H"
+#include "HermitianMatrix.H"
+#include <map>
+
+using namespace amrex;
+
+template<int NF>
+void flag_eln_crossings(const MultiFab& state, iMultiFab& crossing)
+{
+    BL_PROFILE("flag_eln_crossings");
+
+    using GIdx = ::GIdx<NF>;
+    using FlavorMatrix = HermitianMatrix<NF>;
+    const int nF = GIdx::Fx00_Re - GIdx::N00_Re; // offset between N, Fx, Fy and Fz
+
+    // test directions in addition to the flux directions of each cell
+    const Gpu::ManagedVector<GpuArray<Real,3> > test_directions = uniform_sphere_xyz(8);
+    const auto* test_directions_p = test_directions.dataPtr();
+    const int ntest = test_directions.size();
+
+#ifdef _OPENMP
+#pragma omp parallel if (Gpu::notInLaunchRegion())
+#endif
+    for (MFIter mfi(crossing, TilingIfNotGPU()); mfi.isValid(); ++mfi)
+    {
+        const Box& bx = mfi.tilebox();
+        auto const& sarr = state.const_array(mfi);
+        auto const& carr = crossing.array(mfi);
+
+        amrex::ParallelFor(bx,
+        [=] AMREX_GPU_DEVICE (int i, int j, int k)
+        {
+            int has_crossing = 0;
+
+            for (int a=0; a<NF; a++) {
+                const int comp = FlavorMatrix::Re(a,a);
+                const Real N    = sarr(i,j,k, GIdx::N00_Re    + comp);
+                const Real Nbar = sarr(i,j,k, GIdx::N00_Rebar + comp);
+                const Real F   [3] = {sarr(i,j,k, GIdx::N00_Re    + comp +   nF),
+                                      sarr(i,j,k, GIdx::N00_Re    + comp + 2*nF),
+                                      sarr(i,j,k, GIdx::N00_Re    + comp + 3*nF)};
+                const Real Fbar[3] = {sarr(i,j,k, GIdx::N00_Rebar + comp +   nF),
+                                      sarr(i,j,k, GIdx::N00_Rebar + comp + 2*nF),
+                                      sarr(i,j,k, GIdx::N00_Rebar + comp + 3*nF)};
+                if (N <= 0 || Nbar <= 0) continue;
+
+                // a lepton number flux larger than the lepton number density requires a crossing
+                const Real dF[3] = {F[0]-Fbar[0], F[1]-Fbar[1], F[2]-Fbar[2]};
+                if (std::sqrt(dF[0]*dF[0] + dF[1]*dF[1] + dF[2]*dF[2]) > std::abs(N - Nbar)) {
+                    has_crossing = 1;
+                    break;
+                }
+
+                const Real Fmag    = std::sqrt(F   [0]*F   [0] + F   [1]*F   [1] + F   [2]*F   [2]);
+                const Real Fbarmag = std::sqrt(Fbar[0]*Fbar[0] + Fbar[1]*Fbar[1] + Fbar[2]*Fbar[2]);
+                const Real Z    = minerbo_Z(Fmag/N);
+                const Real Zbar = minerbo_Z(Fbarmag/Nbar);
+                const Real Fhat   [3] = {Fmag    > 0 ? F   [0]/Fmag    : 0, Fmag    > 0 ? F   [1]/Fmag    : 0, Fmag    > 0 ? F   [2]/Fmag    : 1};
+                const Real Fbarhat[3] = {Fbarmag > 0 ? Fbar[0]/Fbarmag : 0, Fbarmag > 0 ? Fbar[1]/Fbarmag : 0, Fbarmag > 0 ? Fbar[2]/Fbarmag : 1};
+
+                int sign = 0;
+                for (int itest=0; itest<ntest+4; itest++) {
+                    Real n[3];
+                    for (int d=0; d<3; d++) {
+                        if      (itest <  ntest  ) n[d] = test_directions_p[itest][d];
+                        else if (itest == ntest  ) n[d] =  Fhat[d];
+                        else if (itest == ntest+1) n[d] = -Fhat[d];
+                        else if (itest == ntest+2) n[d] =  Fbarhat[d];
+                        else                       n[d] = -Fbarhat[d];
+                    }
+                    const Real mu    = n[0]*Fhat   [0] + n[1]*Fhat   [1] + n[2]*Fhat   [2];
+                    const Real mubar = n[0]*Fbarhat[0] + n[1]*Fbarhat[1] + n[2]*Fbarhat[2];
+                    const Real G = minerbo_distribution(N, Z, mu) - minerbo_distribution(Nbar, Zbar, mubar);
+                    const int this_sign = G > 0 ? 1 : (G < 0 ? -1 : 0);
+                    if (this_sign != 0 && sign != 0 && this_sign != sign) has_crossing = 1;
+                    if (this_sign != 0) sign = this_sign;
+                }
+            }
+
+            carr(i,j,k) = has_crossing;
+        });
+    }
+}
+
+template<int NF>
+void report_eln_crossings(const MultiFab& state, const FlavoredNeutrinoContainer<NF>& neutrinos)
+{
+    BL_PROFILE("report_eln_crossings");
+
+    const int lev = 0;
+
+    iMultiFab crossing(state.boxArray(), state.DistributionMap(), 1, 0);
+    flag_eln_crossings<NF>(state, crossing);
+
+    // which of the local boxes have crossings
+    std::map<int, int> box_has_crossing;
+    Long ncells_crossing = 0;
+    for (MFIter mfi(crossing); mfi.isValid(); ++mfi) {
+        const int ncrossing = crossing[mfi].sum<RunOn::Device>(mfi.validbox(), 0);
+        box_has_crossing[mfi.index()] = ncrossing > 0;
+        ncells_crossing += ncrossing;
+    }
+
+    Long nboxes_crossing = 0;
+    for (const auto& box : box_has_crossing) nboxes_crossing += box.second;
+
+    // particles that a hybrid scheme would replace by moments
+    Long nparticles_stable = 0, nparticles = 0;
+    for (ParConstIter<PIdx<NF>::nattribs,0,0,0> pti(neutrinos, lev); pti.isValid(); ++pti) {
+        const Long np = pti.numParticles();
+        nparticles += np;
+        if (!box_has_crossing[pti.index()]) nparticles_stable += np;
+    }
+
+    ParallelDescriptor::ReduceLongSum(ncells_crossing);
+    ParallelDescriptor::ReduceLongSum(nboxes_crossing);
+    ParallelDescriptor::ReduceLongSum(nparticles_stable);
+    ParallelDescriptor::ReduceLongSum(nparticles);
+
+    amrex::Print() << "  ELN crossings: " << ncells_crossing << " of " << state.boxArray().numPts() << " cells, "
+                   << nboxes_crossing << " of " << state.boxArray().size() << " boxes; "
+                   << nparticles_stable << " of " << nparticles << " particles are in boxes without crossings" << std::endl;
+}
+
+template void flag_eln_crossings<2>(const MultiFab&, iMultiFab&);
+template void flag_eln_crossings<3>(const MultiFab&, iMultiFab&);
+template void report_eln_crossings(const MultiFab&, const FlavoredNeutrinoContainer<2>&);
+template void report_eln_crossings(const MultiFab&, const FlavoredNeutrinoContainer<3>&);
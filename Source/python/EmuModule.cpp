@@ -0,0 +1,192 @@
+/*
+   Python module (emu) exposing EmuSimulation for in-process analysis.
+   Build it with make python USE_PYTHON=TRUE (requires pybind11).
+
+       import emu
+       emu.initialize(["inputs_fast_flavor", "nsteps=100"])
+       sim = emu.Simulation()
+       while sim.advance_to(sim.time + dt):
+           sim.deposit_moments()
+           for fab in sim.state():       # (ncomp, nz, ny, nx) incl. ghost cells
+               ...
+           for tile in sim.particles():  # (nparticles, nattribs)
+               ...
+       del sim
+       emu.finalize()
+
+   The number of flavors (and so ncomp and nattribs) is num_flavors in the
+   inputs, as for the executable.
+
+   The arrays are NumPy views of the mesh and particle data on this rank, so
+   nothing is copied. They keep the simulation alive but are only valid until
+   the next advance_to, which moves the particles between tiles.
+*/
+
+#include <ctime>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include <AMReX.H>
+#include <AMReX_Arena.H>
+#include <AMReX_ParallelDescriptor.H>
+
+#include "Simulation.H"
+#include "Evolve.H"
+
+namespace py = pybind11;
+using namespace amrex;
+
+namespace
+{
+    // the parameters must outlive the simulation that points to them. Only
+    // the simulation with the num_flavors of the parameters is built.
+    struct PythonSimulation
+    {
+        std::unique_ptr<TestParams> parms;
+        std::unique_ptr<EmuSimulation<2> > simulation2;
+        std::unique_ptr<EmuSimulation<3> > simulation3;
+
+        // call f with the simulation that was built
+        template<typename F>
+        decltype(auto) Visit(F&& f) { return simulation2 ? f(*simulation2) : f(*simulation3); }
+    };
+
+    // the views are only meaningful if the host can address the data
+    void check_host_accessible()
+    {
+#ifdef AMREX_USE_GPU
+        if (!The_Arena()->isManaged())
+            throw std::runtime_error("emu: GPU builds need amrex.the_arena_is_managed=1 for NumPy views");
+#endif
+    }
+
+    // amrex::Initialize reads the inputs file and key=value overrides like a command line
+    void initialize(const std::vector<std::string>& args)
+    {
+        if (amrex::Initialized()) throw std::runtime_error("emu: AMReX is already initialized");
+
+        static std::vector<std::string> arguments;
+        static std::vector<char*> argument_pointers;
+        arguments = {"emu"};
+        arguments.insert(arguments.end(), args.begin(), args.end());
+        argument_pointers.clear();
+        for (auto& argument : arguments) argument_pointers.push_back(argument.data());
+        argument_pointers.push_back(nullptr);
+
+        int argc = arguments.size();
+        char** argv = argument_pointers.data();
+        amrex::Initialize(argc, argv);
+    }
+
+    // one view of shape (ncomp, nz, ny, nx) per box of state on this rank, including the ghost cells
+    py::list state_views(py::object self)
+    {
+        check_host_accessible();
+        MultiFab& state = self.cast<PythonSimulation&>().Visit([] (auto& simulation) -> MultiFab& { return simulation.State(); });
+
+        py::list views;
+        for (MFIter mfi(state); mfi.isValid(); ++mfi) {
+            const Box& box = mfi.fabbox();
+            const auto len = amrex::length(box);
+            const std::vector<py::ssize_t> shape = {state.nComp(), len.z, len.y, len.x};
+            const std::vector<py::ssize_t> strides = {
+                static_cast<py::ssize_t>(sizeof(Real)) * len.x * len.y * len.z,
+                static_cast<py::ssize_t>(sizeof(Real)) * len.x * len.y,
+                static_cast<py::ssize_t>(sizeof(Real)) * len.x,
+                static_cast<py::ssize_t>(sizeof(Real))};
+            views.append(py::array_t<Real>(shape, strides, state[mfi].dataPtr(), self));
+        }
+        return views;
+    }
+
+    // the index bounds (lo, hi) of the boxes viewed by state_views, in the same order
+    py::list state_boxes(py::object self)
+    {
+        MultiFab& state = self.cast<PythonSimulation&>().Visit([] (auto& simulation) -> MultiFab& { return simulation.State(); });
+
+        py::list boxes;
+        for (MFIter mfi(state); mfi.isValid(); ++mfi) {
+            const Box& box = mfi.fabbox();
+            boxes.append(py::make_tuple(py::make_tuple(box.smallEnd(0), box.smallEnd(1), box.smallEnd(2)),
+                                        py::make_tuple(box.bigEnd(0), box.bigEnd(1), box.bigEnd(2))));
+        }
+        return boxes;
+    }
+
+    // one view of shape (nparticles, nattribs) of the real attributes per non-empty tile on this rank
+    template<int NF>
+    py::list particle_views(py::object self, FlavoredNeutrinoContainer<NF>& particles)
+    {
+        using ParticleType = typename FlavoredNeutrinoContainer<NF>::ParticleType;
+        const int lev = 0;
+        py::list views;
+        for (FNParIter<NF> pti(particles, lev); pti.isValid(); ++pti) {
+            const int np = pti.numParticles();
+            if (np == 0) continue;
+            ParticleType* pstruct = &(pti.GetArrayOfStructs()[0]);
+            const std::vector<py::ssize_t> shape = {np, PIdx<NF>::nattribs};
+            const std::vector<py::ssize_t> strides = {static_cast<py::ssize_t>(sizeof(ParticleType)),
+                                                      static_cast<py::ssize_t>(sizeof(ParticleReal))};
+            views.append(py::array_t<ParticleReal>(shape, strides, &pstruct[0].rdata(0), self));
+        }
+        return views;
+    }
+
+    py::list particle_views(py::object self)
+    {
+        check_host_accessible();
+        return self.cast<PythonSimulation&>().Visit([&] (auto& simulation) { return particle_views(self, simulation.Particles()); });
+    }
+}
+
+PYBIND11_MODULE(emu, m)
+{
+    m.doc() = "In-process access to a running Emu simulation";
+
+    m.def("initialize", &initialize, py::arg("args"),
+          "Initialize AMReX with an inputs file and key=value overrides");
+    m.def("finalize", [] () { amrex::Finalize(); },
+          "Finalize AMReX once every Simulation has been deleted");
+
+    py::class_<PythonSimulation>(m, "Simulation")
+        .def(py::init([] (long seed) {
+            // by default a different random seed for each run, as in main()
+            if (seed < 0) seed = time(NULL);
+            amrex::InitRandom(ParallelDescriptor::MyProc()+seed, ParallelDescriptor::NProcs());
+
+            auto self = std::make_unique<PythonSimulation>();
+            self->parms = std::make_unique<TestParams>();
+            self->parms->Initialize();
+            if (self->parms->num_flavors == 2) self->simulation2 = std::make_unique<EmuSimulation<2> >(self->parms.get());
+            else                               self->simulation3 = std::make_unique<EmuSimulation<3> >(self->parms.get());
+            return self;
+        }), py::arg("seed") = -1,
+             "Set up the mesh and particles from the ParmParse parameters")
+        .def("advance_to", [] (PythonSimulation& self, Real target_time) {
+            return self.Visit([&] (auto& simulation) { return simulation.AdvanceTo(target_time); });
+        }, py::arg("target_time"), "Advance to target_time; False once the run is over")
+        .def("deposit_moments", [] (PythonSimulation& self) { self.Visit([] (auto& simulation) { simulation.DepositMoments(); }); },
+             "Deposit the current particles so the state holds the moments at the current time")
+        .def_property_readonly("time", [] (PythonSimulation& self) { return self.Visit([] (auto& simulation) { return simulation.Time(); }); })
+        .def_property_readonly("step", [] (PythonSimulation& self) { return self.Visit([] (auto& simulation) { return simulation.Step(); }); })
+        .def("state", &state_views, "NumPy views of the state on each local box (ncomp, nz, ny, nx)")
+        .def("state_boxes", &state_boxes, "Index bounds (lo, hi) of the boxes returned by state()")
+        .def("particles", &particle_views, "NumPy views of the particle attributes on each local tile")
+        .def_property_readonly("num_flavors", [] (const PythonSimulation& self) { return self.parms->num_flavors; })
+        .def_property_readonly("component_names", [] (PythonSimulation& self) {
+            const auto& names = self.simulation2 ? GIdx<2>::names : GIdx<3>::names;
+            return std::vector<std::string>(names.begin(), names.end());
+        })
+        .def_property_readonly("attribute_names", [] (PythonSimulation& self) {
+            return self.Visit([] (auto& simulation) {
+                const auto names = simulation.Particles().get_attribute_names();
+                return std::vector<std::string>(names.begin(), names.end());
+            });
+        });
+}